@@ -0,0 +1,105 @@
+/*
+ * Cost of zeroed buffers: sf_calloc against sf_malloc followed by memset.
+ *
+ * The "fresh" phase allocates buffers one after another from a heap that keeps growing, so every
+ * one of them lies in pages that have never been handed out and sf_calloc has nothing to clear.
+ * The "reused" phase frees them all and allocates them again, so both have to clear every byte.
+ * Minor page faults count the pages each phase touched.  Each variant runs in its own child
+ * process, on a second thread so that it gets an arena of its own instead of arena 0, whose
+ * pages sf_mem_grow takes from malloc and are never known to be zero.
+ *
+ * usage: bench_calloc [buffers] [kilobytes]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "sfmm.h"
+
+static int buffers = 64;
+static size_t bytes = 1024 * 1024;
+
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static long minor_faults() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_minflt;
+}
+
+static void* zeroed(int useCalloc) {
+    if(useCalloc) {
+        return sf_calloc(1, bytes);
+    }
+    void* p = sf_malloc(bytes);
+    return p == NULL ? NULL : memset(p, 0, bytes);
+}
+
+static void phase(const char* variant, const char* name, int useCalloc, void** buf) {
+    long faults = minor_faults();
+    long t0 = now_ns();
+    for(int i = 0; i < buffers; i++) {
+        if((buf[i] = zeroed(useCalloc)) == NULL) {
+            fprintf(stderr, "heap exhausted after %d buffers\n", i);
+            exit(1);
+        }
+    }
+    long ns = now_ns() - t0;
+    faults = minor_faults() - faults;
+    printf("%-8s %-7s %10.1f %9ld\n", variant, name, (double) buffers * bytes / ns * 1e9 / (1 << 20), faults);
+}
+
+static void* run(void* arg) {
+    int useCalloc = *(int*) arg;
+    const char* variant = useCalloc ? "calloc" : "memset";
+    void** buf = malloc(buffers * sizeof(void*));
+    if(buf == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    phase(variant, "fresh", useCalloc, buf);
+    for(int i = 0; i < buffers; i++) {
+        memset(buf[i], 'a', bytes); //dirty, so that the next phase cannot skip anything
+        sf_free(buf[i]);
+    }
+    phase(variant, "reused", useCalloc, buf);
+    return NULL;
+}
+
+static void bench(int useCalloc) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0) {
+        sf_arena_config(2, SF_ARENA_ROUND_ROBIN);
+        sf_free(sf_malloc(1)); //the main thread takes arena 0
+        pthread_t tid;
+        pthread_create(&tid, NULL, run, &useCalloc);
+        pthread_join(tid, NULL);
+        exit(0);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char* argv[]) {
+    if(argc > 1) buffers = atoi(argv[1]);
+    if(argc > 2) bytes = (size_t) atol(argv[2]) * 1024;
+    if(buffers < 1 || bytes == 0) {
+        fprintf(stderr, "usage: %s [buffers] [kilobytes]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%-8s %-7s %10s %9s\n", "variant", "phase", "MB/s", "minflt");
+    bench(0);
+    bench(1);
+    return 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * Long-run churn of arena 0, writing how the heap evolves as CSV for plotting.
+ *
+ * Random slots out of SLOTS are visited, a full one freed and an empty one filled, with request
+ * sizes drawn from one of these distributions:
+ *
+ *   uniform   16 to 4096 bytes
+ *   bimodal   90% 16 to 128 bytes, 10% 2 to 8 KB
+ *   powerlaw  Pareto with shape 1.2 from 16 bytes, capped at 64 KB
+ *   phase     alternating every interval * 10 calls between 16 to 256 bytes and 1 to 16 KB
+ *
+ * After every interval calls a sample is taken: the heap size, the payload the churn holds, the free
+ * bytes in each of sf_free_list_heads, the largest free block and the external fragmentation,
+ * one minus the largest free block over all free bytes.  Arena 0 is the only arena whose lists
+ * are public, and this benchmark is built with the preload heap in place of lib/sfutil.o, so
+ * that it can grow it well past a few pages.  Each distribution runs in a child process of its
+ * own.
+ *
+ * usage: bench_churn [uniform|bimodal|powerlaw|phase|all] [calls] [interval]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "sfmm.h"
+
+#define SLOTS 16384
+
+static long calls = 10000000;
+static long interval = 100000;
+
+static void* slot[SLOTS];
+static size_t slotSize[SLOTS];
+static size_t live;
+
+static unsigned int xorshift(unsigned int* state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static size_t between(unsigned int* seed, size_t lo, size_t hi) {
+    return lo + xorshift(seed) % (hi - lo + 1);
+}
+
+static size_t uniform(unsigned int* seed, long call) {
+    return between(seed, 16, 4096);
+}
+
+static size_t bimodal(unsigned int* seed, long call) {
+    return xorshift(seed) % 10 != 0 ? between(seed, 16, 128) : between(seed, 2048, 8192);
+}
+
+static size_t powerlaw(unsigned int* seed, long call) {
+    double u = (xorshift(seed) + 1.0) / 4294967296.0; //(0, 1]
+    double size = 16 / pow(u, 1 / 1.2);
+    return size > 65536 ? 65536 : (size_t) size;
+}
+
+static size_t phase(unsigned int* seed, long call) {
+    return call / (10 * interval) % 2 == 0 ? between(seed, 16, 256) : between(seed, 1024, 16384);
+}
+
+static const struct distribution {
+    const char* name;
+    size_t (*size)(unsigned int*, long);
+} distributions[] = {
+    { "uniform", uniform },
+    { "bimodal", bimodal },
+    { "powerlaw", powerlaw },
+    { "phase", phase },
+};
+
+static void sample(const char* name, long call) {
+    size_t freeBytes[NUM_FREE_LISTS] = { 0 }, total = 0, largest = 0;
+    for(int i = 0; i < NUM_FREE_LISTS; i++) {
+        for(sf_block* bp = sf_free_list_heads[i].body.links.next; bp != &sf_free_list_heads[i];
+            bp = bp->body.links.next) {
+            size_t size = (uint32_t) bp->header & ~0xf;
+            freeBytes[i] += size;
+            if(size > largest) {
+                largest = size;
+            }
+        }
+        total += freeBytes[i];
+    }
+
+    printf("%s,%ld,%zu,%zu", name, call, (size_t) ((char*) sf_mem_end() - (char*) sf_mem_start()), live);
+    for(int i = 0; i < NUM_FREE_LISTS; i++) {
+        printf(",%zu", freeBytes[i]);
+    }
+    printf(",%zu,%.6f\n", largest, total == 0 ? 0.0 : 1 - (double) largest / total);
+}
+
+static void churn(const struct distribution* d) {
+    unsigned int seed = 2463534242U;
+    for(long call = 0; call < calls; call++) {
+        int s = xorshift(&seed) % SLOTS;
+        if(slot[s] == NULL) {
+            size_t size = d->size(&seed, call);
+            if((slot[s] = sf_malloc(size)) == NULL) {
+                fprintf(stderr, "%s: sf_malloc(%zu) failed after %ld calls\n", d->name, size, call);
+                exit(1);
+            }
+            slotSize[s] = size;
+            live += size;
+        } else {
+            sf_free(slot[s]);
+            slot[s] = NULL;
+            live -= slotSize[s];
+        }
+        if((call + 1) % interval == 0 || call + 1 == calls) {
+            sample(d->name, call + 1);
+        }
+    }
+}
+
+static void bench(const struct distribution* d) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0) {
+        churn(d);
+        fflush(stdout);
+        exit(0);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char* argv[]) {
+    const char* which = argc > 1 ? argv[1] : "all";
+    if(argc > 2) calls = atol(argv[2]);
+    if(argc > 3) interval = atol(argv[3]);
+    int n = sizeof(distributions) / sizeof(distributions[0]), found = strcmp(which, "all") == 0;
+    for(int i = 0; i < n; i++) {
+        found |= strcmp(which, distributions[i].name) == 0;
+    }
+    if(argc > 4 || !found || calls < 1 || interval < 1) {
+        fprintf(stderr, "usage: %s [uniform|bimodal|powerlaw|phase|all] [calls] [interval]\n", argv[0]);
+        return 1;
+    }
+
+    printf("distribution,call,heap_bytes,live_payload");
+    for(int i = 0; i < NUM_FREE_LISTS; i++) {
+        printf(",free_bytes_%d", i);
+    }
+    printf(",largest_free,external_fragmentation\n");
+    for(int i = 0; i < n; i++) {
+        if(strcmp(which, "all") == 0 || strcmp(which, distributions[i].name) == 0) {
+            bench(&distributions[i]);
+        }
+    }
+    return 0;
+}
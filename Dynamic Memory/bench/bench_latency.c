@@ -0,0 +1,145 @@
+/*
+ * Per-call latency of sf_malloc and sf_free under SF_POLICY_SEGREGATED and SF_POLICY_TLSF.
+ *
+ * The "holes" phase builds the worst case of the Fibonacci lists: thousands of free 48 byte
+ * blocks, kept apart by allocated fences, share the (32, 64] class with a 64 byte request that
+ * none of them can hold, so every request walks the whole class before reaching the wilderness.
+ * The "mixed" phase keeps a random working set of 16 to 4096 byte requests alive.  Each policy
+ * runs in its own child process, on a second thread so that it gets an arena of its own instead
+ * of arena 0, which sf_mem_grow caps at a few pages.
+ *
+ * usage: bench_latency [holes] [rounds]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "sfmm.h"
+
+#define SLOTS 1024 //live blocks in the mixed phase
+
+static int holes = 4096;
+static int rounds = 20000;
+
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int cmp_long(const void* a, const void* b) {
+    long x = *(const long*) a, y = *(const long*) b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char* policy, const char* phase, const char* op, long* ns, int n) {
+    double sum = 0;
+    for(int i = 0; i < n; i++) {
+        sum += ns[i];
+    }
+    qsort(ns, n, sizeof(long), cmp_long);
+    printf("%-10s %-6s %-6s %9.0f %7ld %7ld %7ld %9ld\n", policy, phase, op, sum / n,
+           ns[n / 2], ns[(long) n * 99 / 100], ns[(long) n * 999 / 1000], ns[n - 1]);
+}
+
+static unsigned int xorshift(unsigned int* state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static void* run(void* arg) {
+    const char* policy = (const char*) arg;
+    long* mallocNs = malloc(rounds * sizeof(long));
+    long* freeNs = malloc(rounds * sizeof(long));
+    void** hole = malloc(holes * sizeof(void*));
+    if(mallocNs == NULL || freeNs == NULL || hole == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    char* top = NULL;
+    for(int i = 0; i < holes; i++) {
+        hole[i] = sf_malloc(32); //48 byte block
+        if(hole[i] == NULL || (top = sf_malloc(16)) == NULL) { //32 byte fence that stays allocated
+            fprintf(stderr, "heap exhausted while building holes\n");
+            exit(1);
+        }
+    }
+    for(int i = 0; i < holes; i++) {
+        sf_free(hole[i]);
+    }
+    //holes that absorbed a splinter at the end of a page are 64 bytes, fill them until the
+    //request has to come from the wilderness
+    char* p;
+    while((p = sf_malloc(48)) != NULL && p < top);
+    for(int i = 0; i < rounds; i++) {
+        long t0 = now_ns();
+        p = sf_malloc(48); //64 byte block
+        long t1 = now_ns();
+        sf_free(p);
+        long t2 = now_ns();
+        mallocNs[i] = t1 - t0;
+        freeNs[i] = t2 - t1;
+    }
+    report(policy, "holes", "malloc", mallocNs, rounds);
+    report(policy, "holes", "free", freeNs, rounds);
+
+    void* slot[SLOTS] = { NULL };
+    unsigned int seed = 2463534242U;
+    int nMalloc = 0, nFree = 0;
+    for(int i = 0; i < 2 * rounds; i++) {
+        int s = xorshift(&seed) % SLOTS;
+        long t0 = now_ns();
+        if(slot[s] == NULL) {
+            slot[s] = sf_malloc(16 + xorshift(&seed) % 4081);
+            if(nMalloc < rounds) {
+                mallocNs[nMalloc++] = now_ns() - t0;
+            }
+        } else {
+            sf_free(slot[s]);
+            slot[s] = NULL;
+            if(nFree < rounds) {
+                freeNs[nFree++] = now_ns() - t0;
+            }
+        }
+    }
+    report(policy, "mixed", "malloc", mallocNs, nMalloc);
+    report(policy, "mixed", "free", freeNs, nFree);
+    return NULL;
+}
+
+static void bench(int policy, const char* name) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0) {
+        sf_set_policy(policy);
+        sf_arena_config(2, SF_ARENA_ROUND_ROBIN);
+        sf_free(sf_malloc(1)); //the main thread takes arena 0
+        pthread_t tid;
+        pthread_create(&tid, NULL, run, (void*) name);
+        pthread_join(tid, NULL);
+        exit(0);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char* argv[]) {
+    if(argc > 1) holes = atoi(argv[1]);
+    if(argc > 2) rounds = atoi(argv[2]);
+    if(holes < 1 || rounds < 1) {
+        fprintf(stderr, "usage: %s [holes] [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%-10s %-6s %-6s %9s %7s %7s %7s %9s\n", "policy", "phase", "op",
+           "mean_ns", "p50", "p99", "p99.9", "max");
+    bench(SF_POLICY_SEGREGATED, "segregated");
+    bench(SF_POLICY_TLSF, "tlsf");
+    return 0;
+}
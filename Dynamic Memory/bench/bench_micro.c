@@ -0,0 +1,255 @@
+/*
+ * Workloads run against both sfmm and the system malloc, reporting the mean time per call and
+ * the heap utilization each one reached.
+ *
+ *   fixed-N    blocks of N bytes in random slots, each visit freeing the slot or filling it again
+ *   random     the same churn with the sizes of stress_test, 2^k plus up to 2^k - 1 bytes, k < 13
+ *   realloc    chains growing by 16 to 256 bytes at a time to 64 KB, interleaved so that they
+ *              get in each other's way, then freed and started over
+ *   lifo/fifo  rounds of 1024 blocks of 16 to 512 bytes, freed newest first or oldest first
+ *   large      a few blocks of 64 KB to 1 MB, churned like fixed-N
+ *
+ * Every workload/allocator pair runs twice, each time in a child process of its own on a second
+ * thread, so that sfmm gets an arena of its own instead of arena 0, which sf_mem_grow caps at a
+ * few pages.  The first run is timed.  The second samples the heap instead: utilization is the
+ * peak payload over the peak heap size, sf_utilization for sfmm, and for malloc the payload the
+ * workload itself keeps count of over the arena and mmapped bytes of mallinfo2, which is too
+ * slow to read after every call and is read every SAMPLE_EVERY calls.
+ *
+ * usage: bench_micro [calls]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "sfmm.h"
+
+#define SLOTS 1024 //live blocks of the churn workloads
+#define CHAINS 64
+#define CHAIN_MAX (64 * 1024)
+#define LARGE_SLOTS 16
+#define SAMPLE_EVERY 16
+
+typedef struct allocator {
+    const char* name;
+    void* (*malloc)(size_t);
+    void* (*realloc)(void*, size_t);
+    void (*free)(void*);
+} allocator;
+
+static const allocator allocators[] = {
+    { "sfmm", sf_malloc, sf_realloc, sf_free },
+    { "malloc", malloc, realloc, free },
+};
+
+static const allocator* alloc;
+static long calls = 200000;
+static int sampling = 0;
+
+//The workload's blocks, their requested sizes and the bookkeeping of the sampling run
+static void* slot[SLOTS];
+static size_t slotSize[SLOTS];
+static long done;
+static size_t live, peakLive, peakHeap;
+static double mainHeap; //arena 0's heap, where the main thread took its block
+
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static unsigned int xorshift(unsigned int* state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static void sample() {
+    if(live > peakLive) {
+        peakLive = live;
+    }
+    if(alloc->malloc != sf_malloc && done % SAMPLE_EVERY == 0) {
+        struct mallinfo2 mi = mallinfo2();
+        if(mi.arena + mi.hblkhd > peakHeap) {
+            peakHeap = mi.arena + mi.hblkhd;
+        }
+    }
+}
+
+static void fail(const char* op, size_t size) {
+    fprintf(stderr, "%s %s(%zu) failed after %ld calls\n", alloc->name, op, size, done);
+    exit(1);
+}
+
+//Allocate slot s, which is empty
+static void put(int s, size_t size) {
+    if((slot[s] = alloc->malloc(size)) == NULL) {
+        fail("malloc", size);
+    }
+    *(char*) slot[s] = 1; //a block nobody touches hides the cost of its first cache miss
+    slotSize[s] = size;
+    live += size;
+    done++;
+    if(sampling) sample();
+}
+
+//Free slot s, which is allocated
+static void drop(int s) {
+    alloc->free(slot[s]);
+    slot[s] = NULL;
+    live -= slotSize[s];
+    done++;
+    if(sampling) sample();
+}
+
+//Resize slot s, which is allocated
+static void grow(int s, size_t size) {
+    if((slot[s] = alloc->realloc(slot[s], size)) == NULL) {
+        fail("realloc", size);
+    }
+    live += size - slotSize[s];
+    slotSize[s] = size;
+    done++;
+    if(sampling) sample();
+}
+
+static void drop_all() {
+    for(int s = 0; s < SLOTS; s++) {
+        if(slot[s] != NULL) {
+            drop(s);
+        }
+    }
+}
+
+//Visit random slots among the first n, freeing a full one and filling an empty one with size(seed)
+static void churn(int n, size_t (*size)(unsigned int*)) {
+    unsigned int seed = 2463534242U;
+    while(done < calls) {
+        int s = xorshift(&seed) % n;
+        if(slot[s] == NULL) {
+            put(s, size(&seed));
+        } else {
+            drop(s);
+        }
+    }
+    drop_all();
+}
+
+static size_t fixedSize;
+static size_t fixed(unsigned int* seed) { return fixedSize; }
+static size_t stress(unsigned int* seed) {
+    int order = xorshift(seed) % 13;
+    return ((size_t) 1 << order) + xorshift(seed) % ((size_t) 1 << order);
+}
+static size_t large(unsigned int* seed) { return 64 * 1024 + xorshift(seed) % (960 * 1024); }
+
+static void fixed_16() { fixedSize = 16; churn(SLOTS, fixed); }
+static void fixed_64() { fixedSize = 64; churn(SLOTS, fixed); }
+static void fixed_256() { fixedSize = 256; churn(SLOTS, fixed); }
+static void fixed_1k() { fixedSize = 1024; churn(SLOTS, fixed); }
+static void fixed_4k() { fixedSize = 4096; churn(SLOTS, fixed); }
+static void random_sizes() { churn(SLOTS, stress); }
+static void large_blocks() { churn(LARGE_SLOTS, large); }
+
+static void realloc_chains() {
+    unsigned int seed = 2463534242U;
+    for(int s = 0; done < calls; s = (s + 1) % CHAINS) {
+        if(slot[s] == NULL) {
+            put(s, 16);
+        } else if(slotSize[s] >= CHAIN_MAX) {
+            drop(s);
+        } else {
+            grow(s, slotSize[s] + 16 + xorshift(&seed) % 241);
+        }
+    }
+    drop_all();
+}
+
+static void free_order(int lifo) {
+    unsigned int seed = 2463534242U;
+    while(done < calls) {
+        for(int s = 0; s < SLOTS; s++) {
+            put(s, 16 + xorshift(&seed) % 497);
+        }
+        for(int s = 0; s < SLOTS; s++) {
+            drop(lifo ? SLOTS - 1 - s : s);
+        }
+    }
+}
+
+static void lifo() { free_order(1); }
+static void fifo() { free_order(0); }
+
+static const struct workload {
+    const char* name;
+    void (*run)();
+} workloads[] = {
+    { "fixed-16", fixed_16 },
+    { "fixed-64", fixed_64 },
+    { "fixed-256", fixed_256 },
+    { "fixed-1024", fixed_1k },
+    { "fixed-4096", fixed_4k },
+    { "random", random_sizes },
+    { "realloc", realloc_chains },
+    { "lifo", lifo },
+    { "fifo", fifo },
+    { "large", large_blocks },
+};
+
+static void* run(void* arg) {
+    const struct workload* w = arg;
+    long t0 = now_ns();
+    w->run();
+    long ns = now_ns() - t0;
+    if(!sampling) {
+        printf("%-11s %-7s %9.1f", w->name, alloc->name, (double) ns / done);
+    } else {
+        if(alloc->malloc == sf_malloc) { //sf_utilization is (peak payload + 1) / (heap + mainHeap)
+            peakHeap = (peakLive + 1) / sf_utilization() - mainHeap;
+        }
+        printf(" %11.4f\n", peakHeap == 0 ? 0.0 : (double) peakLive / peakHeap);
+    }
+    fflush(stdout);
+    return NULL;
+}
+
+static void bench(const struct workload* w, const allocator* a, int sample) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0) {
+        alloc = a;
+        sampling = sample;
+        sf_arena_config(2, SF_ARENA_ROUND_ROBIN);
+        sf_free(sf_malloc(1)); //the main thread takes arena 0
+        mainHeap = 1 / sf_utilization();
+        pthread_t tid;
+        pthread_create(&tid, NULL, run, (void*) w);
+        pthread_join(tid, NULL);
+        exit(0);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char* argv[]) {
+    if(argc > 1) calls = atol(argv[1]);
+    if(argc > 2 || calls < 1) {
+        fprintf(stderr, "usage: %s [calls]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%-11s %-7s %9s %11s\n", "workload", "alloc", "ns/call", "utilization");
+    for(size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        for(size_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); a++) {
+            bench(&workloads[w], &allocators[a], 0);
+            bench(&workloads[w], &allocators[a], 1);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,283 @@
+/*
+ * Replays an allocation trace against sfmm and reports throughput, per-call latency, the peak of
+ * sf_utilization over the run and sf_fragmentation at its end.
+ *
+ * Two trace formats are read.  A binary trace written by sf_trace_start (SF_TRACE=file with
+ * bin/libsfmm.so records any program) starts with SF_TRACE_MAGIC; its blocks are known by
+ * address, and each address is given a slot of its own for as long as the block lives.  Anything
+ * else is read as a malloclab text trace: a header of numbers (suggested heap size, ids, ops,
+ * weight), then one operation per line, "a id size", "r id size" or "f id".  Frees and reallocs of
+ * blocks the trace never allocated, as when recording started late, are skipped and become
+ * allocations respectively.
+ *
+ * The trace is replayed twice, each time in a child process of its own on a second thread, so that
+ * it gets an arena of its own instead of arena 0, which sf_mem_grow caps at a few pages: once
+ * untimed but for the whole run, for ops/s, and once timing every call and sampling
+ * sf_utilization after each.
+ *
+ * usage: bench_replay trace [segregated|tlsf]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "sfmm.h"
+
+#define NONE UINT32_MAX //no slot
+
+typedef struct op {
+    char type; //an SF_TRACE_ operation
+    uint32_t slot;
+    uint64_t size;
+    uint64_t align;
+} op;
+
+static op* ops = NULL;
+static size_t nOps = 0, capOps = 0;
+static uint32_t nSlots = 0;
+static int policy = SF_POLICY_SEGREGATED;
+
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int cmp_long(const void* a, const void* b) {
+    long x = *(const long*) a, y = *(const long*) b;
+    return (x > y) - (x < y);
+}
+
+static void add_op(char type, uint32_t slot, uint64_t size, uint64_t align) {
+    if(nOps == capOps) {
+        capOps = capOps == 0 ? 4096 : 2 * capOps;
+        if((ops = realloc(ops, capOps * sizeof(op))) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    ops[nOps++] = (op) { type, slot, size, align };
+}
+
+/*
+ * Addresses of a binary trace to slots, by open addressing.  An entry is never removed: a free
+ * sets its slot to NONE, and the next block at the same address gets a new one.
+ */
+static uint64_t* mapKey = NULL;
+static uint32_t* mapSlot = NULL;
+static size_t mapMask = 0;
+
+static uint32_t* map_find(uint64_t addr) {
+    size_t i = (addr >> 4) * 0x9E3779B97F4A7C15ULL & mapMask;
+    while(mapKey[i] != 0 && mapKey[i] != addr) {
+        i = (i + 1) & mapMask;
+    }
+    if(mapKey[i] == 0) {
+        mapKey[i] = addr;
+        mapSlot[i] = NONE;
+    }
+    return &mapSlot[i];
+}
+
+static void load_binary(FILE* f, long bytes) {
+    size_t n = (bytes - 8) / sizeof(sf_trace_record);
+    sf_trace_record* rec = malloc(n * sizeof(sf_trace_record));
+    if(rec == NULL || fread(rec, sizeof(sf_trace_record), n, f) != n) {
+        fprintf(stderr, "cannot read trace\n");
+        exit(1);
+    }
+    for(mapMask = 1; mapMask < 2 * n; mapMask <<= 1);
+    mapKey = calloc(mapMask, sizeof(uint64_t));
+    mapSlot = malloc(mapMask * sizeof(uint32_t));
+    if(mapKey == NULL || mapSlot == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    mapMask--;
+
+    for(size_t i = 0; i < n; i++) {
+        uint32_t* slot = map_find(rec[i].id);
+        switch(rec[i].op) {
+            case SF_TRACE_MALLOC:
+            case SF_TRACE_CALLOC:
+            case SF_TRACE_MEMALIGN:
+                *slot = nSlots++;
+                add_op(rec[i].op, *slot, rec[i].size, rec[i].aux);
+                break;
+            case SF_TRACE_REALLOC: {
+                uint32_t s = *slot;
+                *slot = NONE;
+                if(s == NONE) { //allocated before the trace started
+                    if(rec[i].aux == 0) {
+                        break;
+                    }
+                    s = nSlots++;
+                }
+                add_op(SF_TRACE_REALLOC, s, rec[i].size, 0);
+                if(rec[i].aux != 0) {
+                    *map_find(rec[i].aux) = s;
+                }
+                break;
+            }
+            case SF_TRACE_FREE:
+                if(*slot != NONE) {
+                    add_op(SF_TRACE_FREE, *slot, 0, 0);
+                    *slot = NONE;
+                }
+                break;
+        }
+    }
+    free(rec);
+    free(mapKey);
+    free(mapSlot);
+}
+
+static void load_text(FILE* f) {
+    char word[64];
+    //skip the header numbers
+    long pos = ftell(f);
+    while(fscanf(f, "%63s", word) == 1 && strspn(word, "0123456789.") == strlen(word)) {
+        pos = ftell(f);
+    }
+    fseek(f, pos, SEEK_SET);
+
+    char type;
+    unsigned long id, size = 0;
+    while(fscanf(f, " %c %lu", &type, &id) == 2) {
+        if((type == 'a' || type == 'r') && fscanf(f, "%lu", &size) != 1) {
+            break;
+        }
+        if(id >= nSlots) {
+            nSlots = id + 1;
+        }
+        add_op(type == 'a' ? SF_TRACE_MALLOC : type == 'r' ? SF_TRACE_REALLOC : SF_TRACE_FREE, id, size, 0);
+    }
+}
+
+static void load(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if(f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    char magic[8];
+    fseek(f, 0, SEEK_END);
+    long bytes = ftell(f);
+    rewind(f);
+    if(bytes >= 8 && fread(magic, 1, 8, f) == 8 && memcmp(magic, SF_TRACE_MAGIC, 8) == 0) {
+        load_binary(f, bytes);
+    } else {
+        rewind(f);
+        load_text(f);
+    }
+    fclose(f);
+}
+
+//Carry out one operation on the block of its slot, 0 if an allocation failed
+static int replay(op* o, void** block) {
+    void** p = &block[o->slot];
+    switch(o->type) {
+        case SF_TRACE_MALLOC:
+            return (*p = sf_malloc(o->size)) != NULL || o->size == 0;
+        case SF_TRACE_CALLOC:
+            return (*p = sf_calloc(1, o->size)) != NULL || o->size == 0;
+        case SF_TRACE_MEMALIGN:
+            return (*p = sf_memalign(o->align, o->size)) != NULL || o->size == 0;
+        case SF_TRACE_REALLOC:
+            if(*p == NULL) {
+                return (*p = sf_malloc(o->size)) != NULL || o->size == 0;
+            } else {
+                void* q = sf_realloc(*p, o->size);
+                if(q == NULL && o->size != 0) {
+                    return 0; //the old block is still there
+                }
+                *p = q;
+                return 1;
+            }
+        case SF_TRACE_FREE:
+            if(*p != NULL) {
+                sf_free(*p);
+                *p = NULL;
+            }
+            return 1;
+    }
+    return 1;
+}
+
+static void* run_throughput(void* arg) {
+    void** block = calloc(nSlots + 1, sizeof(void*));
+    size_t failed = 0;
+    long t0 = now_ns();
+    for(size_t i = 0; i < nOps; i++) {
+        failed += !replay(&ops[i], block);
+    }
+    long ns = now_ns() - t0;
+    printf("%-12s ops/s %12.0f  (%zu ops in %.3f ms, %zu failed)\n", (char*) arg,
+           nOps / (ns / 1e9), nOps, ns / 1e6, failed);
+    return NULL;
+}
+
+static void* run_latency(void* arg) {
+    void** block = calloc(nSlots + 1, sizeof(void*));
+    long* ns = malloc(nOps * sizeof(long));
+    if(block == NULL || ns == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    double peak = 0, sum = 0;
+    for(size_t i = 0; i < nOps; i++) {
+        long t0 = now_ns();
+        replay(&ops[i], block);
+        ns[i] = now_ns() - t0;
+        sum += ns[i];
+        double util = sf_utilization();
+        if(util > peak) {
+            peak = util;
+        }
+    }
+    double frag = sf_fragmentation();
+    qsort(ns, nOps, sizeof(long), cmp_long);
+    printf("%-12s latency ns  mean %.0f  p50 %ld  p99 %ld  p99.9 %ld  max %ld\n", (char*) arg,
+           sum / nOps, ns[nOps / 2], ns[nOps * 99 / 100], ns[nOps * 999 / 1000], ns[nOps - 1]);
+    printf("%-12s peak utilization %.4f  final fragmentation %.4f\n", (char*) arg, peak, frag);
+    return NULL;
+}
+
+static void bench(void* (*run)(void*), const char* name) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0) {
+        sf_set_policy(policy);
+        sf_arena_config(2, SF_ARENA_ROUND_ROBIN);
+        sf_free(sf_malloc(1)); //the main thread takes arena 0
+        pthread_t tid;
+        pthread_create(&tid, NULL, run, (void*) name);
+        pthread_join(tid, NULL);
+        fflush(stdout);
+        exit(0);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char* argv[]) {
+    if(argc < 2 || argc > 3 || (argc == 3 && strcmp(argv[2], "segregated") != 0 && strcmp(argv[2], "tlsf") != 0)) {
+        fprintf(stderr, "usage: %s trace [segregated|tlsf]\n", argv[0]);
+        return 1;
+    }
+    const char* name = argc == 3 ? argv[2] : "segregated";
+    policy = strcmp(name, "tlsf") == 0 ? SF_POLICY_TLSF : SF_POLICY_SEGREGATED;
+
+    load(argv[1]);
+    if(nOps == 0) {
+        fprintf(stderr, "%s: no operations\n", argv[1]);
+        return 1;
+    }
+    printf("%s: %zu ops on %u blocks\n", argv[1], nOps, nSlots);
+    bench(run_throughput, name);
+    bench(run_latency, name);
+    return 0;
+}
@@ -0,0 +1,259 @@
+/*
+ * Scalability of sfmm from 1 to N threads, on the classic allocator stress tests:
+ *
+ *   threadtest     each thread allocates rounds of 1000 64 byte blocks and frees them again
+ *   larson         each thread replaces random blocks of 16 to 1024 bytes in an array of its
+ *                  own, and between rounds the arrays move on to the next thread, which frees
+ *                  what the previous one allocated, as in a server handing off connections
+ *   xmalloc        threads in pairs, one allocating 16 to 256 byte blocks and passing them to
+ *                  the other through a ring, which frees them
+ *   cache-scratch  each thread frees an 8 byte block the main thread allocated next to the
+ *                  others, then allocates, writes and frees 8 byte blocks, which share cache
+ *                  lines with other threads' only if the allocator hands them back out
+ *
+ * Every thread makes the same number of calls, so perfect scaling keeps the per-thread time flat
+ * and multiplies the throughput.  Each run is a child process of its own, whose main thread
+ * takes arena 0, which sf_mem_grow caps at a few pages, so that every worker has a mapped arena
+ * of its own.  One CSV line is printed per benchmark and thread count: the calls and seconds of
+ * the run, calls per second, the mean and the worst of the threads' nanoseconds per call, and the
+ * peak resident size of the child, which is made up almost entirely of heap.
+ *
+ * usage: bench_threads [max_threads] [calls_per_thread]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "sfmm.h"
+
+#define THREADTEST_BLOCKS 1000
+#define LARSON_SLOTS 1000
+#define LARSON_ROUNDS 10
+#define RING 1024 //blocks in flight between an xmalloc pair
+#define SCRATCH_WRITES 100 //writes to each cache-scratch block
+
+typedef struct worker {
+    pthread_t tid;
+    int id;
+    long start, end; //when this thread began and finished its calls
+    unsigned int seed;
+} worker;
+
+static int threads;
+static long calls = 200000;
+static worker* workers;
+static pthread_barrier_t start, handOff; //all threads with main, the workers alone
+
+static void*** larsonSlots; //the array of each larson thread, moved on every round
+static void** scratch; //the blocks each cache-scratch thread starts by freeing
+
+typedef struct ring {
+    void* block[RING];
+    long head, tail; //written by the consumer and the producer
+} ring;
+static ring* rings;
+
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static unsigned int xorshift(unsigned int* state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static void* checked(void* block) {
+    if(block == NULL) {
+        fprintf(stderr, "heap exhausted\n");
+        exit(1);
+    }
+    *(char*) block = 1;
+    return block;
+}
+
+static void threadtest(worker* w) {
+    void* block[THREADTEST_BLOCKS];
+    for(long done = 0; done < calls; done += 2 * THREADTEST_BLOCKS) {
+        for(int i = 0; i < THREADTEST_BLOCKS; i++) {
+            block[i] = checked(sf_malloc(64));
+        }
+        for(int i = 0; i < THREADTEST_BLOCKS; i++) {
+            sf_free(block[i]);
+        }
+    }
+}
+
+static void larson(worker* w) {
+    for(int round = 0; round < LARSON_ROUNDS; round++) {
+        void** slot = larsonSlots[(w->id + round) % threads];
+        for(long i = 0; i < calls / LARSON_ROUNDS / 2; i++) {
+            int s = xorshift(&w->seed) % LARSON_SLOTS;
+            sf_free(slot[s]);
+            slot[s] = checked(sf_malloc(16 + xorshift(&w->seed) % 1009));
+        }
+        pthread_barrier_wait(&handOff); //hand the array on
+    }
+}
+
+static void xmalloc(worker* w) {
+    if(w->id == threads - 1 && threads % 2 == 1) { //no partner, allocate and free alone
+        void* block[RING];
+        for(long done = 0; done < calls; done += 2 * RING) {
+            for(int i = 0; i < RING; i++) {
+                block[i] = checked(sf_malloc(16 + xorshift(&w->seed) % 241));
+            }
+            for(int i = 0; i < RING; i++) {
+                sf_free(block[i]);
+            }
+        }
+        return;
+    }
+
+    ring* r = &rings[w->id / 2];
+    if(w->id % 2 == 0) { //producer
+        for(long i = 0; i < calls; i++) {
+            long tail = r->tail;
+            while(tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == RING) {
+                sched_yield();
+            }
+            r->block[tail % RING] = checked(sf_malloc(16 + xorshift(&w->seed) % 241));
+            __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+        }
+    } else { //consumer
+        for(long i = 0; i < calls; i++) {
+            long head = r->head;
+            while(__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head) {
+                sched_yield();
+            }
+            sf_free(r->block[head % RING]);
+            __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+static void cache_scratch(worker* w) {
+    sf_free(scratch[w->id]);
+    for(long i = 0; i < calls / 2; i++) {
+        volatile char* p = checked(sf_malloc(8));
+        for(int j = 0; j < SCRATCH_WRITES; j++) {
+            p[j % 8]++;
+        }
+        sf_free((void*) p);
+    }
+}
+
+static const struct benchmark {
+    const char* name;
+    void (*run)(worker*);
+} benchmarks[] = {
+    { "threadtest", threadtest },
+    { "larson", larson },
+    { "xmalloc", xmalloc },
+    { "cache-scratch", cache_scratch },
+};
+static const struct benchmark* current;
+
+static void* run(void* arg) {
+    worker* w = arg;
+    if(current->run == larson) { //filled by its first thread, in that thread's arena
+        larsonSlots[w->id] = malloc(LARSON_SLOTS * sizeof(void*));
+        for(int s = 0; s < LARSON_SLOTS; s++) {
+            larsonSlots[w->id][s] = checked(sf_malloc(16 + xorshift(&w->seed) % 1009));
+        }
+    }
+    pthread_barrier_wait(&start);
+    w->start = now_ns();
+    current->run(w);
+    w->end = now_ns();
+    return NULL;
+}
+
+//The blocks a benchmark needs set up by the main thread before the workers start
+static void prepare() {
+    if(current->run == larson) {
+        larsonSlots = malloc(threads * sizeof(void**));
+    } else if(current->run == xmalloc) {
+        rings = calloc(threads / 2 + 1, sizeof(ring));
+    } else if(current->run == cache_scratch) {
+        scratch = malloc(threads * sizeof(void*));
+        for(int t = 0; t < threads; t++) {
+            scratch[t] = checked(sf_malloc(8));
+        }
+    }
+}
+
+static void bench(const struct benchmark* b, int nThreads) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0) {
+        current = b;
+        threads = nThreads;
+        sf_arena_config(SF_MAX_ARENAS, SF_ARENA_ROUND_ROBIN);
+        sf_free(sf_malloc(1)); //the main thread takes arena 0
+        prepare();
+
+        workers = calloc(threads, sizeof(worker));
+        pthread_barrier_init(&start, NULL, threads + 1);
+        pthread_barrier_init(&handOff, NULL, threads);
+        for(int t = 0; t < threads; t++) {
+            workers[t].id = t;
+            workers[t].seed = 2463534242U + t;
+            pthread_create(&workers[t].tid, NULL, run, &workers[t]);
+        }
+        pthread_barrier_wait(&start);
+        for(int t = 0; t < threads; t++) {
+            pthread_join(workers[t].tid, NULL);
+        }
+
+        long first = workers[0].start, last = workers[0].end;
+        double sum = 0, worst = 0;
+        for(int t = 0; t < threads; t++) {
+            if(workers[t].start < first) first = workers[t].start;
+            if(workers[t].end > last) last = workers[t].end;
+            double perCall = (double) (workers[t].end - workers[t].start) / calls;
+            sum += perCall;
+            if(perCall > worst) {
+                worst = perCall;
+            }
+        }
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        long total = calls * threads;
+        long ns = last - first;
+        printf("%s,%d,%ld,%.6f,%.0f,%.1f,%.1f,%ld\n", b->name, threads, total, ns / 1e9,
+               total / (ns / 1e9), sum / threads, worst, ru.ru_maxrss);
+        fflush(stdout);
+        exit(0);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char* argv[]) {
+    int maxThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(argc > 1) maxThreads = atoi(argv[1]);
+    if(argc > 2) calls = atol(argv[2]);
+    if(maxThreads < 1 || maxThreads > SF_MAX_ARENAS - 1 || calls < 2 * THREADTEST_BLOCKS) {
+        fprintf(stderr, "usage: %s [max_threads] [calls_per_thread]\n", argv[0]);
+        fprintf(stderr, "  max_threads from 1 to %d, calls_per_thread at least %d\n",
+                SF_MAX_ARENAS - 1, 2 * THREADTEST_BLOCKS);
+        return 1;
+    }
+
+    printf("benchmark,threads,calls,seconds,calls_per_sec,thread_ns_mean,thread_ns_max,peak_rss_kb\n");
+    for(size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+        for(int t = 1; t <= maxThreads; t = t < maxThreads && 2 * t > maxThreads ? maxThreads : 2 * t) {
+            bench(&benchmarks[b], t);
+        }
+    }
+    return 0;
+}
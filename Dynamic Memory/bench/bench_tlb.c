@@ -0,0 +1,152 @@
+/*
+ * Pointer chasing through a heap of small blocks, with sf_thp off and on, to show what backing
+ * the heap with transparent huge pages does to TLB misses.
+ *
+ * The blocks are linked into one cycle in random order, so that every hop lands on a page of its
+ * own as far as the TLB can tell, and the time per hop is mostly the cost of the misses.  dTLB
+ * load misses are counted with perf_event_open where the kernel and the CPU allow it (otherwise
+ * they are printed as -1, and perf stat -e dTLB-load-misses on the whole run will do).  Each mode
+ * runs in a child process of its own on a second thread, so that the heap is in an arena of its
+ * own instead of arena 0, which sf_mem_grow caps at a few pages.  Both grow the heap in the same
+ * steps, so sf_thp is the only difference; the huge pages backing the heap are read from sf_stats.
+ *
+ * usage: bench_tlb [blocks] [hops]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include "sfmm.h"
+
+#define BLOCK_SIZE 64 //payload of each block, a cache line
+
+typedef struct node {
+    struct node* next;
+    char pad[BLOCK_SIZE - sizeof(struct node*)];
+} node;
+
+static long blocks = 1L << 20;
+static long hops = 20000000;
+static int useThp;
+static node* volatile sink; //where the chase ends, so that it is not optimized away
+
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static unsigned int xorshift(unsigned int* state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+//A counter of the calling thread's dTLB load misses in user space, -1 if there is none
+static int dtlb_counter() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void* run(void* arg) {
+    node** order = malloc(blocks * sizeof(node*));
+    if(order == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for(long i = 0; i < blocks; i++) {
+        if((order[i] = sf_malloc(sizeof(node))) == NULL) {
+            fprintf(stderr, "sf_malloc failed after %ld blocks\n", i);
+            exit(1);
+        }
+    }
+    unsigned int seed = 2463534242U;
+    for(long i = blocks - 1; i > 0; i--) { //Fisher-Yates
+        long j = xorshift(&seed) % (i + 1);
+        node* swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+    for(long i = 0; i < blocks; i++) {
+        order[i]->next = order[(i + 1) % blocks];
+    }
+    node* p = order[0];
+    free(order);
+
+    int fd = dtlb_counter();
+    long long misses = -1;
+    if(fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    long t0 = now_ns();
+    for(long i = 0; i < hops; i++) {
+        p = p->next;
+    }
+    long ns = now_ns() - t0;
+    sink = p;
+    if(fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if(read(fd, &misses, sizeof(misses)) != sizeof(misses)) {
+            misses = -1;
+        }
+        close(fd);
+    }
+
+    struct sf_stats stats;
+    sf_stats(&stats);
+    printf("%-4s %9ld %10ld %8.2f %12lld %10.4f %9zu %8.1f\n", useThp ? "on" : "off", blocks, hops,
+           (double) ns / hops, misses, misses < 0 ? -1.0 : (double) misses / hops, stats.thp_pages,
+           stats.heap_size / 1048576.0);
+    fflush(stdout);
+    return NULL;
+}
+
+static void bench(int thp) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0) {
+        useThp = thp;
+        sf_thp(thp);
+        sf_heap_growth(1 << 21, 1 << 26);
+        sf_arena_config(2, SF_ARENA_ROUND_ROBIN);
+        sf_free(sf_malloc(1)); //the main thread takes arena 0
+        pthread_t tid;
+        pthread_create(&tid, NULL, run, NULL);
+        pthread_join(tid, NULL);
+        exit(0);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char* argv[]) {
+    if(argc > 1) blocks = atol(argv[1]);
+    if(argc > 2) hops = atol(argv[2]);
+    if(argc > 3 || blocks < 2 || hops < 1) {
+        fprintf(stderr, "usage: %s [blocks] [hops]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%-4s %9s %10s %8s %12s %10s %9s %8s\n", "thp", "blocks", "hops", "ns/hop", "dtlb_misses",
+           "misses/hop", "thp_pages", "heap_mb");
+    bench(0);
+    bench(1);
+    return 0;
+}
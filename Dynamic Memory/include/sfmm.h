@@ -60,6 +60,19 @@
     NOTE: Footer contents must always be identical to header contents.
 */
 
+/*
+ * Allocated blocks keep the footer above unless SF_FOOTERS is defined as 0 at compile time.  Its
+ * prv alloc bit may lag the header's while the block stays allocated, as a neighbour freed or
+ * split beside it updates only the header; the footer is rewritten whenever the block is freed.
+ * Without it only free blocks have one: the prv alloc bit of the next block tells whether there
+ * is a footer to read, and the row an allocated block's footer would take is the last row of its
+ * payload instead.  block_size is then payload_size + 8 rounded up to a multiple of 16, at least
+ * 32, which saves a row for every size that is 1 to 8 more than a multiple of 16.
+ */
+#ifndef SF_FOOTERS
+#define SF_FOOTERS 1
+#endif
+
 typedef size_t sf_header;
 typedef size_t sf_footer;
 
@@ -198,6 +211,9 @@ void *sf_malloc(size_t size);
  *
  * If sf_realloc is called with a valid pointer and a size of 0 it should free
  * the allocated block and return NULL without setting sf_errno.
+ *
+ * A block grows in place when the block after it is free or the heap can be extended
+ * behind it; only otherwise is the old payload copied to a new block.
  */
 void *sf_realloc(void *ptr, size_t size);
 
@@ -211,12 +227,189 @@ void *sf_realloc(void *ptr, size_t size);
  */
 void sf_free(void *ptr);
 
+/*
+ * Frees a block whose requested size the caller knows, as for C++ sized delete.  Instead of the
+ * neighbour checks of sf_free, which read the previous block, only the block's own header is
+ * checked against size; building with DEBUG defined adds the full checks of sf_free.
+ *
+ * @param ptr Address of memory returned by sf_malloc or one of the functions below.
+ * @param size The size that was requested for it, the last one passed to sf_realloc if any.
+ *
+ * If ptr is invalid, or size does not match it, the function calls abort().
+ */
+void sf_free_sized(void *ptr, size_t size);
+
+/*
+ * Allocates n blocks of size bytes each in one call.  The blocks are carved one after another
+ * out of a single free block, under one lock, so they lie next to each other in the heap; if no
+ * free block can hold them all, they are carved out in smaller groups.
+ *
+ * @param size The number of bytes requested for each block.
+ * @param n The number of blocks.
+ * @param out Where the n payload addresses are stored.
+ *
+ * @return The number of blocks allocated, stored at the front of out.  It is n unless memory ran
+ * out, in which case sf_errno is set to ENOMEM and the blocks already allocated are kept.  If
+ * size is 0, then 0 is returned without setting sf_errno.
+ */
+size_t sf_malloc_batch(size_t size, size_t n, void **out);
+
+/*
+ * Frees n blocks in one call.  The heap blocks are taken in address order, and every run of
+ * blocks that lie next to each other is merged and coalesced with its free neighbours at once.
+ *
+ * @param ptrs The addresses to free, each as for sf_free.  The array is reordered.
+ * @param n The number of addresses.
+ *
+ * If any of the addresses is invalid, or appears twice, the function calls abort().  The check is
+ * made as each block comes to be freed, so the blocks ahead of it in the reordered array have
+ * been freed already by then.
+ */
+void sf_free_batch(void **ptrs, size_t n);
+
+/*
+ * Acquires zeroed memory for an array of nmemb elements of size bytes each.  Only memory that has
+ * been allocated before is cleared: the parts of the heap past the highest block ever allocated
+ * are still zero from when they were mapped, as are blocks above the sf_mmap_threshold.  Arena 0,
+ * whose pages sf_mem_grow takes from malloc, is always cleared.
+ *
+ * @param nmemb The number of elements.
+ * @param size The size of each element.
+ *
+ * @return As for sf_malloc with a size of nmemb * size.  If that product overflows, NULL is
+ * returned and sf_errno is set to ENOMEM.
+ */
+void *sf_calloc(size_t nmemb, size_t size);
+
+/*
+ * Acquires uninitialized memory whose address is a multiple of align.  The block is carved out of
+ * a free block so that its payload lands on the boundary, and the free space in front of it goes
+ * back to the free lists.  The result is an ordinary block: it is released with sf_free, and
+ * sf_realloc keeps the address when it shrinks or grows the block in place (a block that has to
+ * move gets the usual 16 byte alignment).  A request above the sf_mmap_threshold is only mapped
+ * when align is at most 32; larger alignments are always served from the heap.
+ *
+ * @param align The alignment, a power of 2.  Alignments up to 16 are those of sf_malloc.
+ * @param size The number of bytes requested to be allocated.
+ *
+ * @return As for sf_malloc.  If align is not a power of 2, NULL is returned and sf_errno is set
+ * to EINVAL.
+ */
+void *sf_memalign(size_t align, size_t size);
+
+/*
+ * The C11 name of sf_memalign.  size need not be a multiple of align.
+ */
+void *sf_aligned_alloc(size_t align, size_t size);
+
+/*
+ * Stores in *memptr a pointer to size bytes aligned to align, as sf_memalign.  sf_errno is left
+ * as it was.
+ *
+ * @param memptr Where the address is stored on success, NULL if size is 0.
+ * @param align The alignment, a power of 2 and a multiple of sizeof(void *).
+ * @param size The number of bytes requested to be allocated.
+ *
+ * @return 0 on success, EINVAL if align is invalid, or ENOMEM if there is no memory available.
+ */
+int sf_posix_memalign(void **memptr, size_t align, size_t size);
+
+/*
+ * Get the number of bytes the caller may use at ptr, which can exceed the size requested for it.
+ * sf_realloc keeps all of them when it moves the block.
+ *
+ * @param ptr Address of memory returned by sf_malloc or one of the functions above.
+ *
+ * @return The usable size of the block.  ptr is not checked.
+ */
+size_t sf_usable_size(void *ptr);
+
+/*
+ * Take and release the locks of every arena, for use as pthread_atfork handlers: a child that
+ * forks while another thread is inside the allocator would otherwise inherit a held lock.
+ * sf_unlock_all serves for both the parent and the child.
+ */
+void sf_lock_all();
+void sf_unlock_all();
+
+/* Trace records written by sf_trace_start, one per allocation or free. */
+typedef struct sf_trace_record {
+    uint64_t time; //nanoseconds since sf_trace_start
+    uint64_t id;   //payload address allocated or freed, the old address for SF_TRACE_REALLOC
+    uint64_t aux;  //SF_TRACE_REALLOC: the new address, 0 if freed; SF_TRACE_MEMALIGN: the alignment
+    uint64_t size; //requested size, 0 for a free whose size is not known
+    uint32_t op;   //one of the SF_TRACE_ operations
+    uint32_t zero; //0, so that no record holds padding
+} sf_trace_record;
+
+#define SF_TRACE_MAGIC "sftrace2" //the 8 bytes a trace file starts with, followed by the records
+#define SF_TRACE_MALLOC 'a'   //sf_malloc, and each block of sf_malloc_batch
+#define SF_TRACE_CALLOC 'c'   //sf_calloc, with size the product of its arguments
+#define SF_TRACE_MEMALIGN 'm' //sf_memalign and the other aligned calls
+#define SF_TRACE_REALLOC 'r'  //sf_realloc
+#define SF_TRACE_FREE 'f'     //sf_free, sf_free_sized and each pointer of sf_free_batch
+
+/*
+ * Starts recording every allocation and free made through the functions above to the file at
+ * path, which is created or truncated.  Records are buffered and written in blocks, in an order
+ * the calls could have happened in even across threads; bench_replay plays them back.  A child
+ * forked while a trace is open does not record into it.
+ *
+ * @param path The file to write the trace to.
+ *
+ * @return 0 on success.  If a trace is already being recorded, -1 is returned and sf_errno is set
+ * to EBUSY; if the file cannot be written, -1 is returned and sf_errno says why.
+ */
+int sf_trace_start(const char *path);
+
+/*
+ * Writes out the records still buffered and closes the trace, if one is open.
+ */
+void sf_trace_stop();
+
+/*
+ * Sets the mean number of bytes allocated between two samples of the heap profiler, 0 to stop
+ * sampling.  The allocation that a thread's count of allocated bytes runs out on has its call
+ * stack recorded, and the count starts over from an exponentially distributed interval, so that
+ * allocations are sampled in proportion to their size.  Samples are kept until their blocks are
+ * freed, and followed through sf_realloc; sf_prof_dump writes out those that are live.  Turning
+ * sampling off keeps the samples already taken.  The default is SF_PROF_RATE, 0 unless defined
+ * at compile time.
+ *
+ * @param bytes The mean sampling interval, 512 KB is a usual choice.
+ *
+ * @return The previous interval.  If the sample table cannot be mapped, sampling stays as it was
+ * and sf_errno is set to ENOMEM.
+ */
+size_t sf_prof_rate(size_t bytes);
+
+#define SF_PROF_TEXT 0  //each call stack with the bytes and objects its samples stand for, largest first
+#define SF_PROF_PPROF 1 //the legacy heap profile of gperftools, read by pprof with the program
+
+/*
+ * Writes the call stacks of the live sampled blocks to the file at path, which is created or
+ * truncated.  The text format estimates the live bytes behind every sample from the interval
+ * it was taken at; a pprof profile gives the sampled bytes, for pprof to scale by the last
+ * interval other than 0 set with sf_prof_rate.  Frees wait for the dump to finish.
+ *
+ * @param path The file to write the profile to.
+ * @param format SF_PROF_TEXT or SF_PROF_PPROF.
+ *
+ * @return 0 on success.  If format is neither, -1 is returned and sf_errno is set to EINVAL; if
+ * the file cannot be written, -1 is returned and sf_errno says why.
+ */
+int sf_prof_dump(const char *path, int format);
+
 /*
  * Get the current amount of internal fragmentation of the heap.
  *
  * @return  the current amount of internal fragmentation, defined to be the
  * ratio of the total amount of payload to the total size of allocated blocks.
  * If there are no allocated blocks, then the returned value should be 0.0.
+ * Blocks in a thread or CPU cache count as allocated blocks without payload.
+ * Payload another thread handed out or took back through those caches is
+ * only counted once that thread next takes an arena's lock: on a refill or
+ * spill, or at its exit.
  */
 double sf_fragmentation();
 
@@ -228,10 +421,242 @@ double sf_fragmentation();
  * utilization at a given time, as defined in the lecture and textbook,
  * is the ratio of the maximum aggregate payload up to that time, divided
  * by the current heap size.  If the heap has not yet been initialized,
- * this function should return 0.0.
+ * this function should return 0.0.  With several arenas in use, the peaks
+ * of the individual arenas are summed and divided by the total heap size.
+ * Pages given back by sf_trim are no longer part of the heap size, so after
+ * a trim the ratio may exceed 1.0.  Cached payload is counted as for
+ * sf_fragmentation, when it is folded in under a lock, so a peak reached and
+ * left between two folds is missed.
  */
 double sf_utilization();
 
+/*
+ * Sets how many bytes of recently freed small blocks each thread may keep in its private cache.
+ * Cached blocks are handed back out by sf_malloc without touching sf_free_list_heads, and are
+ * returned to the free lists in batches, when a thread exceeds the limit, or when it exits.
+ * The default comes from SF_TCACHE_BYTES at compile time and is 0, which disables the caches.
+ *
+ * @param bytes The new per-thread limit in bytes, 0 to disable caching.
+ *
+ * @return The previous limit.
+ */
+size_t sf_tcache_limit(size_t bytes);
+
+/*
+ * Returns every block held in the calling thread's cache to the free lists.
+ */
+void sf_tcache_flush();
+
+/*
+ * Sets how many bytes of recently freed small blocks each CPU may keep in a cache shared by the
+ * threads running on it.  The caches are taken and filled with restartable sequences (Linux
+ * rseq), without a lock or an atomic instruction, and bound the cached memory by the number of
+ * CPUs instead of threads; they come before the per-thread caches when both are on.  Lowering
+ * the limit empties the caches of every CPU, from the calling thread's own CPU with membarrier
+ * fences.  On kernels without them (before Linux 5.10) the calling thread visits each CPU in
+ * turn instead, and a CPU its affinity rules out keeps its blocks until its threads free again.
+ * Where rseq is not available (not x86-64, or not registered by the C library) this sets the
+ * per-thread limit instead, as sf_tcache_limit does.  The default comes from SF_CPU_CACHE_BYTES
+ * at compile time and is 0.
+ *
+ * @param bytes The new per-CPU limit in bytes, 0 to disable the caches.
+ *
+ * @return The previous limit.  If a CPU's cache could not be emptied, sf_errno is set to EAGAIN.
+ */
+size_t sf_cpu_cache_limit(size_t bytes);
+
+/*
+ * Sets the largest request, at most 128 bytes, that sf_malloc serves from slab pages.  A slab
+ * page is a page of the heap given over to objects of a single size class (16, 32, ..., 128
+ * bytes) that carry no header or footer; the object size is found from the page the pointer
+ * falls in.  Larger requests keep using blocks with headers and footers.  The default comes
+ * from SF_SLAB_MAX at compile time and is 0, which turns slab pages off.
+ *
+ * @param size The largest request to serve from slab pages, 0 to disable them.
+ *
+ * @return The previous limit.
+ */
+size_t sf_slab_limit(size_t size);
+
+/*
+ * Sets the largest request, at most 128 bytes, that sf_malloc serves from compact pages.  A
+ * compact page is a page of the heap split into blocks of its own, with 32-bit headers and free
+ * lists linked by 32-bit offsets within the page, so that a block takes its request plus 4 bytes
+ * rounded up to 16, and at least 16 bytes instead of the 32 of the smallest heap block.  Blocks
+ * are found first fit and coalesce with their neighbours in the page; sf_usable_size reports the
+ * 12 bytes of a 16 byte block.  Compact pages come before slab pages when both serve a request.
+ * The default comes from SF_COMPACT_MAX at compile time and is 0, which turns compact pages off.
+ *
+ * @param size The largest request to serve from compact pages, 0 to disable them.
+ *
+ * @return The previous limit.
+ */
+size_t sf_compact_limit(size_t size);
+
+/* Policies for choosing the arena that serves a thread's allocations. */
+#define SF_ARENA_ROUND_ROBIN 0 //a thread is bound to the next arena in turn on its first allocation
+#define SF_ARENA_BY_CPU 1      //each allocation uses the arena of the CPU the thread is running on
+
+/* Upper bound on the number of arenas. */
+#define SF_MAX_ARENAS 64
+
+/*
+ * Configures the independent arenas allocations are spread over.  Each arena has its own lock,
+ * free lists, wilderness block and statistics.  Arena 0 is the heap grown by sf_mem_grow and is
+ * the one described by sf_free_list_heads.  sf_free and sf_realloc accept a pointer from any
+ * arena, and threads that have already been bound to an arena keep it.
+ *
+ * @param count The number of arenas to use, from 1 to SF_MAX_ARENAS.  Defaults to SF_ARENAS (8).
+ * @param policy SF_ARENA_ROUND_ROBIN (the default) or SF_ARENA_BY_CPU.
+ *
+ * @return 0 on success.  On an invalid argument -1 is returned and sf_errno is set to EINVAL.
+ */
+int sf_arena_config(int count, int policy);
+
+/*
+ * Turns remote frees on or off.  While on, a thread that frees a block of an arena it does not
+ * allocate from does not take that arena's lock: the block is pushed onto a lock-free queue of
+ * the arena, and freed for real by the next thread of the arena that allocates, all queued
+ * blocks at once under the lock it takes anyway, or by sf_trim or sf_stats.  Until then a queued
+ * block counts as allocated.  Huge blocks and sf_free_batch are not queued.  The default is
+ * SF_REMOTE_FREE, 0 unless defined at compile time.
+ *
+ * @param on 1 to queue frees of other arenas' blocks, 0 to free them under their arena's lock.
+ *
+ * @return The previous setting.
+ */
+int sf_remote_free(int on);
+
+/*
+ * Hands memory the heaps are not using back to the OS.  The free block at the top of each heap
+ * is cut down to keep bytes and the pages after it are returned (arena 0, which sf_mem_grow
+ * cannot shrink, keeps them but they stop being resident).  Every other free block gives up the
+ * whole pages between its header and footer.  Free blocks stay on their free lists, and their
+ * pages come back when they are allocated again.
+ *
+ * @param keep The number of free bytes to leave at the top of each heap.
+ *
+ * @return The number of bytes handed back by this call.
+ */
+size_t sf_trim(size_t keep);
+
+/*
+ * Makes sf_free trim the top of a heap back to bytes / 2 whenever a free leaves more than bytes
+ * free there.  The default comes from SF_TRIM_THRESHOLD at compile time and is 0, which leaves
+ * trimming to sf_trim.
+ *
+ * @param bytes The size of the free top of a heap that triggers trimming, 0 to disable it.
+ *
+ * @return The previous threshold.
+ */
+size_t sf_trim_threshold(size_t bytes);
+
+/*
+ * Get the number of bytes trimming has handed back to the OS so far.  Pages that are reused and
+ * handed back again count each time.
+ */
+size_t sf_released();
+
+/*
+ * Sets how much the heap grows by whenever it has to.  Each extension is made in one step and
+ * adds the current heap size, clamped to between minChunk and maxChunk, so the heap doubles
+ * until it reaches the cap; a request that needs more than that gets all it needs at once.
+ * Sizes are rounded up to whole pages.  The defaults come from SF_GROW_MIN and SF_GROW_MAX at
+ * compile time and are both PAGE_SZ, which grows the heap by just what a request needs.
+ *
+ * @param minChunk The least an extension adds, at least 1.
+ * @param maxChunk The most an extension adds unless a request needs more, at least minChunk.
+ *
+ * @return 0 on success.  On an invalid argument -1 is returned and sf_errno is set to EINVAL.
+ */
+int sf_heap_growth(size_t minChunk, size_t maxChunk);
+
+/*
+ * Turns transparent huge pages on or off for the heaps of arenas 1 and up, whose slices of
+ * address space start on 2 MB boundaries.  While on, a heap grows up to the next 2 MB boundary
+ * and the new space is advised with MADV_HUGEPAGE, so that the kernel can back it with huge
+ * pages and one TLB entry covers 512 times as much of the heap.  Trimming then hands back whole
+ * huge pages only, which keeps the rest of the heap on huge pages.  Arena 0, which sf_mem_grow
+ * grows a page at a time, is left alone, and a kernel short of huge pages or with them disabled
+ * falls back to small ones; sf_stats counts the huge pages actually in place.  The default
+ * comes from SF_THP at compile time and is 0.
+ *
+ * @param on 1 to grow heaps in huge pages, 0 to grow them as sf_heap_growth says.
+ *
+ * @return The previous setting.
+ */
+int sf_thp(int on);
+
+/*
+ * Sets the request size from which sf_malloc gives a block a private anonymous mapping instead
+ * of carving it out of the heap.  Such a block is unmapped by sf_free, resized with mremap by
+ * sf_realloc (which moves it back into the heap if it shrinks below the threshold), and never
+ * grows the heap.  It counts towards sf_fragmentation but not sf_utilization.  Requests over
+ * 4 GB cannot be mapped.  The default comes from SF_MMAP_THRESHOLD at compile time and is 0,
+ * which keeps every request in the heap.
+ *
+ * @param bytes The smallest request to map, 0 to disable mapping.
+ *
+ * @return The previous threshold.
+ */
+size_t sf_mmap_threshold(size_t bytes);
+
+/* Policies for finding a free block that fits a request. */
+#define SF_POLICY_SEGREGATED 0 //the Fibonacci size classes of sf_free_list_heads, first fit within a class
+#define SF_POLICY_TLSF 1       //two-level segregated fit, no list is ever searched
+
+/*
+ * Selects how free blocks are indexed in arenas that set up their heap after this call; an
+ * arena keeps the policy it started with.  Under SF_POLICY_TLSF free blocks are kept in lists
+ * by first level class (a power of 2) and second level class (one of 16 equal steps inside it),
+ * with a bitmap for each level, so sf_malloc and sf_free take constant time apart from growing
+ * the heap.  Blocks, the prologue and the epilogue look the same under both policies, but a
+ * TLSF arena leaves its sf_free_list_heads lists empty.  The default comes from SF_POLICY at
+ * compile time and is SF_POLICY_SEGREGATED.
+ *
+ * @param policy SF_POLICY_SEGREGATED or SF_POLICY_TLSF.
+ *
+ * @return 0 on success.  On an invalid argument -1 is returned and sf_errno is set to EINVAL.
+ */
+int sf_set_policy(int policy);
+
+/*
+ * Statistics of one size class of sf_free_list_heads, over every arena.  Blocks go by their
+ * own size whichever policy indexes them, and a block the heap splits, merges or hands out is
+ * counted in the class of its size at that time.  Blocks served from or kept in a thread cache
+ * or a slab or compact page never reach the heap and are not counted.
+ */
+struct sf_class_stats {
+    size_t free_blocks; //free blocks now, the wilderness included
+    size_t free_bytes;
+    size_t mallocs; //blocks handed out by the heap, one for a whole sf_malloc_batch
+    size_t frees; //blocks given back to it
+    size_t splits; //free blocks split in two for a smaller request
+    size_t coalesces; //free blocks made by merging neighbours
+    size_t searches; //free list searches for a request of the class
+    size_t search_nodes; //free blocks those searches looked at, search_nodes / searches on average
+};
+
+struct sf_stats {
+    struct sf_class_stats classes[NUM_FREE_LISTS];
+    size_t heap_size; //as for sf_utilization, without huge blocks
+    size_t wilderness_size; //free bytes at the end of the heaps
+    size_t extensions; //times a heap grew
+    size_t failed; //requests the heap could not grow enough for
+    size_t thp_pages; //2 MB pages the kernel backs the heaps of arenas 1 and up with, see sf_thp
+};
+
+/*
+ * Fills in heap statistics.  The counters are kept in each arena and updated under the lock
+ * the operation already holds, so they cost no more than an add each; compiling with
+ * -DSF_STATS=0 removes them, and leaves them 0 here.  The free blocks are counted by walking
+ * the free lists, which takes each arena's lock for as long as that takes, and the huge pages
+ * by reading /proc/self/smaps.
+ *
+ * @param out Where to put the statistics.
+ */
+void sf_stats(struct sf_stats *out);
+
 
 /* sfutil.c: Helper functions already created for this assignment. */
 
@@ -0,0 +1,130 @@
+/*
+ * The C allocation functions on top of sfmm, for loading into an unmodified program with
+ * LD_PRELOAD=bin/libsfmm.so.  Only the differences from sfmm are handled here: malloc(0) and the
+ * like return a block of their own, free(NULL) and realloc(NULL, size) are allowed, and failures
+ * set errno.  Nothing needs initializing first, so allocations made by the dynamic loader and by
+ * constructors that run before ours work as well.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sfmm.h"
+
+#define PROF_RATE 524288 //sampling interval of SF_PROF without SF_PROF_RATE
+
+static char profPath[PATH_MAX];
+static int profFormat = SF_PROF_PPROF;
+
+//SF_TRACE=file records the program's allocations for bench_replay.  SF_PROF=file samples them
+//every SF_PROF_RATE bytes and writes the live ones to file at exit, for pprof, or as text with
+//SF_PROF_FORMAT=text.  The variables are removed again, so that the programs it runs do not
+//start the same files over.
+__attribute__((constructor)) static void preload_init() {
+    pthread_atfork(sf_lock_all, sf_unlock_all, sf_unlock_all);
+    const char* trace = getenv("SF_TRACE");
+    if(trace != NULL) {
+        sf_trace_start(trace);
+        unsetenv("SF_TRACE");
+    }
+
+    const char* prof = getenv("SF_PROF");
+    if(prof != NULL && strlen(prof) < sizeof(profPath)) {
+        const char* rate = getenv("SF_PROF_RATE");
+        const char* format = getenv("SF_PROF_FORMAT");
+        strcpy(profPath, prof);
+        profFormat = format != NULL && strcmp(format, "text") == 0 ? SF_PROF_TEXT : SF_PROF_PPROF;
+        sf_prof_rate(rate != NULL && atol(rate) > 0 ? atol(rate) : PROF_RATE);
+        unsetenv("SF_PROF");
+        unsetenv("SF_PROF_RATE");
+        unsetenv("SF_PROF_FORMAT");
+    }
+}
+
+__attribute__((destructor)) static void preload_fini() {
+    sf_trace_stop();
+    if(profPath[0] != '\0') {
+        sf_prof_dump(profPath, profFormat);
+    }
+}
+
+void *malloc(size_t size) {
+    void* payload = sf_malloc(size == 0 ? 1 : size);
+    if(payload == NULL) {
+        errno = ENOMEM;
+    }
+    return payload;
+}
+
+void free(void *ptr) {
+    if(ptr != NULL) {
+        sf_free(ptr);
+    }
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    void* payload = nmemb == 0 || size == 0 ? sf_calloc(1, 1) : sf_calloc(nmemb, size);
+    if(payload == NULL) {
+        errno = ENOMEM;
+    }
+    return payload;
+}
+
+void *realloc(void *ptr, size_t size) {
+    if(ptr == NULL) {
+        return malloc(size);
+    }
+    if(size == 0) {
+        sf_free(ptr);
+        return NULL;
+    }
+    void* payload = sf_realloc(ptr, size);
+    if(payload == NULL) {
+        errno = ENOMEM;
+    }
+    return payload;
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size) {
+    size_t total;
+    if(__builtin_mul_overflow(nmemb, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, total);
+}
+
+void *memalign(size_t align, size_t size) {
+    void* payload = sf_memalign(align, size == 0 ? 1 : size);
+    if(payload == NULL) {
+        errno = sf_errno;
+    }
+    return payload;
+}
+
+void *aligned_alloc(size_t align, size_t size) {
+    return memalign(align, size);
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size) {
+    return sf_posix_memalign(memptr, align, size == 0 ? 1 : size);
+}
+
+void *valloc(size_t size) {
+    return memalign(PAGE_SZ, size);
+}
+
+void *pvalloc(size_t size) {
+    if(size > SIZE_MAX - PAGE_SZ) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return memalign(PAGE_SZ, (size + PAGE_SZ - 1) & ~(PAGE_SZ - 1));
+}
+
+size_t malloc_usable_size(void *ptr) {
+    return ptr == NULL ? 0 : sf_usable_size(ptr);
+}
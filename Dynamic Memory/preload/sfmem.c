@@ -0,0 +1,64 @@
+/*
+ * The sf_mem_* heap of libsfmm.so, in place of lib/sfutil.o, whose heap is a fixed block of 27
+ * pages taken from malloc.  Here arena 0 grows through one reservation of SF_MEM_RESERVE bytes of
+ * address space, set up on first use, and pages are made accessible SF_MEM_COMMIT bytes at a time
+ * as sf_mem_grow reaches them.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sys/mman.h>
+#include "sfmm.h"
+
+#ifndef SF_MEM_RESERVE
+#define SF_MEM_RESERVE ((size_t)1 << 32)
+#endif
+
+#ifndef SF_MEM_COMMIT
+#define SF_MEM_COMMIT ((size_t)64 * PAGE_SZ)
+#endif
+
+static char* memStart = NULL;
+static char* memEnd = NULL; //end of the pages handed out
+static char* memCommit = NULL; //end of the pages made accessible
+static pthread_once_t memOnce = PTHREAD_ONCE_INIT;
+
+static void mem_init() {
+    void* base = mmap(NULL, SF_MEM_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(base != MAP_FAILED) { //otherwise sf_mem_grow always fails
+        memStart = base;
+        memEnd = base;
+        memCommit = base;
+    }
+}
+
+void *sf_mem_start() {
+    pthread_once(&memOnce, mem_init);
+    return memStart;
+}
+
+void *sf_mem_end() {
+    pthread_once(&memOnce, mem_init);
+    return memEnd;
+}
+
+//Only called with arena 0's lock held
+void *sf_mem_grow() {
+    pthread_once(&memOnce, mem_init);
+    if(memStart == NULL || memEnd + PAGE_SZ > memStart + SF_MEM_RESERVE) {
+        return NULL;
+    }
+    if(memEnd + PAGE_SZ > memCommit) {
+        size_t len = SF_MEM_COMMIT;
+        if(len > (size_t) (memStart + SF_MEM_RESERVE - memCommit)) {
+            len = memStart + SF_MEM_RESERVE - memCommit;
+        }
+        if(mprotect(memCommit, len, PROT_READ | PROT_WRITE) != 0) {
+            return NULL;
+        }
+        memCommit += len;
+    }
+
+    void* page = memEnd;
+    memEnd += PAGE_SZ;
+    return page;
+}
@@ -1,25 +1,418 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "debug.h"
 #include "sfmm.h"
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <execinfo.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+#define CPU_CACHE_RSEQ 1 //restartable sequences are written for x86-64 only
+#endif
+#endif
 
 #define MAX_BLK_SIZE 0xFFFFFFF0
-static size_t maxPayload = 0; //max aggregate payload
-static size_t currPayload = 0; //current payload in use
-static size_t memUsed = 0; //memory allocated
-static size_t heapSize = 0; //heap size
-static int listEmpty = 0; //0 if heap not yet touched, else 1
-//blocks to help contain memory currently used from heap
-static sf_block* prologue = NULL;
-static sf_block* epilogue = NULL;
+#define BLK_OVERHEAD (SF_FOOTERS ? 16 : 8) //bytes of an allocated block that are not payload
+
+//Per-thread cache of small freed blocks, SF_TCACHE_BYTES is the default byte limit (0 = off)
+#ifndef SF_TCACHE_BYTES
+#define SF_TCACHE_BYTES 0
+#endif
+#define TCACHE_MAX_BLK 512 //largest padded block size a thread cache will hold
+#define TCACHE_BINS ((TCACHE_MAX_BLK - 32) / 16 + 1) //one bin per padded size 32, 48, ..., 512
+#define TCACHE_BATCH 8 //blocks moved per refill from the shared free lists
+#define TCACHE_BIN(size) (((size) - 32) >> 4)
+
+//Per-CPU cache of small freed blocks, SF_CPU_CACHE_BYTES is the default byte limit per CPU (0 = off)
+#ifndef SF_CPU_CACHE_BYTES
+#define SF_CPU_CACHE_BYTES 0
+#endif
+#define CPU_CACHE_SLOTS 64 //most blocks one bin of a CPU's cache holds
+
+//Slab tier for small requests, SF_SLAB_MAX is the default largest request it serves (0 = off)
+#ifndef SF_SLAB_MAX
+#define SF_SLAB_MAX 0
+#endif
+#define SLAB_MAX_OBJ 128 //largest slab object size
+#define SLAB_CLASSES (SLAB_MAX_OBJ / 16) //one class per object size 16, 32, ..., 128
+#define SLAB_HDR 64 //bytes at the start of a slab page ahead of the first object
+#define SLAB_TAIL 32 //bytes at the end of a slab page after the last object, the queued map
+#define SLAB_MAP_BITS (SF_ARENA_RESERVE / PAGE_SZ + 1) //pages a slab map can describe
+
+//Compact pages for small requests, SF_COMPACT_MAX is the default largest request they serve (0 = off)
+#ifndef SF_COMPACT_MAX
+#define SF_COMPACT_MAX 0
+#endif
+#define COMPACT_MAX_OBJ SLAB_MAX_OBJ //largest compact request, so sf_free_sized looks for either page alike
+#define CPAGE_FIRST (SLAB_HDR - 4) //offset of the first block in a compact page, its payload at SLAB_HDR
+#define CPAGE_END (PAGE_SZ - 4) //offset of the epilogue header closing a compact page
+#define CPAGE_WORD(page, offset) (*(uint32_t*) ((char*) (page) + (offset)))
+
+//Number of arenas threads are spread over unless sf_arena_config says otherwise
+#ifndef SF_ARENAS
+#define SF_ARENAS 8
+#endif
+//Address space set aside for each arena after arena 0, which lives in the sf_mem_grow heap
+#ifndef SF_ARENA_RESERVE
+#define SF_ARENA_RESERVE ((size_t)1 << 28)
+#endif
+
+//Heap growth policy: each extension adds at least SF_GROW_MIN and at most SF_GROW_MAX bytes,
+//doubling the heap in between, unless the request being served needs more
+#ifndef SF_GROW_MIN
+#define SF_GROW_MIN PAGE_SZ
+#endif
+#ifndef SF_GROW_MAX
+#define SF_GROW_MAX PAGE_SZ
+#endif
+
+//Heaps after arena 0 grow to whole transparent huge pages, advised with MADV_HUGEPAGE, unless
+//SF_THP is 0
+#ifndef SF_THP
+#define SF_THP 0
+#endif
+#define THP_SZ ((size_t)1 << 21) //size of a huge page, SF_ARENA_RESERVE should be a multiple of it
+
+//Frees that leave more than SF_TRIM_THRESHOLD bytes free at the top of a heap trim it (0 = off),
+//SF_TRIM_ADVICE is how pages inside free blocks are handed back
+#ifndef SF_TRIM_THRESHOLD
+#define SF_TRIM_THRESHOLD 0
+#endif
+#ifndef SF_TRIM_ADVICE
+#define SF_TRIM_ADVICE MADV_DONTNEED
+#endif
+
+//Frees by threads of another arena go to that arena's remote queue unless SF_REMOTE_FREE is 0
+#ifndef SF_REMOTE_FREE
+#define SF_REMOTE_FREE 0
+#endif
+
+//Requests of at least SF_MMAP_THRESHOLD bytes get a mapping of their own (0 = off)
+#ifndef SF_MMAP_THRESHOLD
+#define SF_MMAP_THRESHOLD 0
+#endif
+#define HUGE_MAX_PAYLOAD 0xFFFFFFFFUL //the header keeps 32 bits of payload size
+
+#define TRACE_RECORDS 2048 //records buffered before a trace is written out
+
+//Mean bytes allocated between two heap profile samples of arenas set up before any sf_prof_rate
+//call (0 = off)
+#ifndef SF_PROF_RATE
+#define SF_PROF_RATE 0
+#endif
+#define PROF_DEPTH 32 //frames kept per sample
+#define PROF_BUCKETS 65536 //lists of profTable
+#define PROF_BUCKET(payload) (((uintptr_t) (payload) >> 4) * 0x9E3779B97F4A7C15ULL >> 48)
+#define PROF_CHUNK 1024 //samples mapped at a time
+#define PROF_RECHECK (1L << 20) //bytes a thread allocates between looks at a profRate of 0
+
+//Heap operation counters reported by sf_stats, kept unless SF_STATS is 0
+#ifndef SF_STATS
+#define SF_STATS 1
+#endif
+#if SF_STATS
+#define STAT(stmt) stmt
+#else
+#define STAT(stmt)
+#endif
+
+//Free block policy of arenas set up before any sf_set_policy call
+#ifndef SF_POLICY
+#define SF_POLICY SF_POLICY_SEGREGATED
+#endif
+#define TLSF_SL_LOG 4
+#define TLSF_SL (1 << TLSF_SL_LOG) //second level lists per first level class
+#define TLSF_SMALL 256 //blocks below this size all sit in first level class 0, one list per 16 bytes
+#define TLSF_FL 25 //first level class f > 0 holds sizes [2^(f+7), 2^(f+8)), up to MAX_BLK_SIZE
+#define TLSF_LISTS (TLSF_FL * TLSF_SL)
+
+/*
+ * An arena is a self-contained heap with its own prologue/epilogue, free lists, wilderness block
+ * and statistics, all guarded by its own lock.  Arena 0 is the heap grown by sf_mem_grow and its
+ * free lists are sf_free_list_heads.  Every other arena grows a page at a time inside its own
+ * SF_ARENA_RESERVE slice of one address space reservation, so the arena owning any pointer can
+ * be found with a subtraction and a division.
+ */
+struct sf_slab;
+
+/*
+ * A huge block sits alone in an anonymous mapping, after links to the other huge blocks of the
+ * arena that counts it.  Its header has 0x2 set and the arena's index in place of the block
+ * size, and prev_footer holds the length of the mapping.  The payload is always 32 bytes past a
+ * page boundary, which with the 0x2 bit and the links is how sf_free tells such blocks apart.
+ */
+typedef struct sf_huge {
+    struct sf_huge* next;
+    struct sf_huge* prev;
+    sf_block block;
+} sf_huge;
+
+typedef struct sf_arena {
+    pthread_mutex_t lock;
+    sf_block* heads; //the NUM_FREE_LISTS sentinels of this arena
+    sf_block ownHeads[NUM_FREE_LISTS]; //storage for heads in every arena but arena 0
+    unsigned int nonEmpty; //bit i is set while free list i has a block in it
+    int policy; //SF_POLICY_SEGREGATED or SF_POLICY_TLSF, fixed when the heap is set up
+    sf_block* tlsfHeads; //the TLSF_LISTS sentinels, mapped the first time the arena uses TLSF
+    unsigned int tlsfFl; //bit f is set while first level class f has a non-empty list
+    unsigned short tlsfSl[TLSF_FL]; //bit s of entry f is set while list f * TLSF_SL + s is non-empty
+    int listEmpty; //0 if heap not yet touched, else 1
+    //blocks to help contain memory currently used from heap
+    sf_block* prologue;
+    sf_block* epilogue;
+    void* brk; //end of the pages handed out so far, arenas other than arena 0 only
+    char* fresh; //end of the highest block ever allocated, NULL in arena 0 whose memory need not start zeroed
+    size_t maxPayload; //max aggregate payload
+    size_t currPayload; //current payload in use
+    size_t memUsed; //memory allocated
+    size_t heapSize; //heap size
+    struct sf_slab* slabs[SLAB_CLASSES]; //slab pages of each class that still have a free slot
+    struct sf_cpage* compact; //compact pages that still have a free block
+    uint64_t* slabMap; //one bit per page of the arena, set if the page is a slab page
+    char* slabBase; //address of the page bit 0 of slabMap stands for
+    sf_huge huge; //sentinel of the huge blocks counted in this arena, links NULL until the first
+    size_t hugePayload; //payload of those blocks, kept out of currPayload and maxPayload
+    size_t hugeMapped; //bytes mapped for them, kept out of memUsed and heapSize
+    size_t released; //bytes handed back to the OS by trimming
+    sf_block* remoteFrees; //blocks freed by threads of other arenas, pushed without the lock
+#if SF_STATS
+    struct sf_stats stats; //counters only, the rest is filled in by sf_stats
+#endif
+} sf_arena;
+
+//arena 0 is usable before arena_init_all runs, sf_free may see one of its pointers first
+static sf_arena arenas[SF_MAX_ARENAS] = { [0] = { .lock = PTHREAD_MUTEX_INITIALIZER, .heads = sf_free_list_heads } };
+static int arenaCount = SF_ARENAS;
+static int arenaPolicy = SF_ARENA_ROUND_ROBIN;
+static unsigned int nextArena = 0; //round robin cursor
+static char* arenaBase = NULL; //reservation backing arenas 1 to SF_MAX_ARENAS - 1
+static pthread_once_t arenaOnce = PTHREAD_ONCE_INIT;
+static __thread sf_arena* threadArena = NULL;
+
+/*
+ * A thread cache holds blocks that are still marked allocated in the heap, so neighbours never
+ * coalesce into them.  They are chained through body.links.next, while body.links.prev is set to
+ * &tcacheKey so that a second sf_free of the same pointer can be caught.  Payload handed out or
+ * taken back without a lock is accumulated per arena in payloadDelta and folded into that arena's
+ * currPayload the next time the thread holds the arena's lock, sf_fragmentation and
+ * sf_utilization included.  Other threads' deltas are only seen once they take a lock.
+ */
+typedef struct tcache {
+    sf_block* bins[TCACHE_BINS];
+    size_t bytes; //total block bytes held in bins
+    long payloadDelta[SF_MAX_ARENAS]; //payload change not yet folded into each arena's currPayload
+    int state; //0 = untouched, 1 = registered for flush at thread exit, 2 = thread exiting
+} tcache;
+
+/*
+ * A slab page is the page-aligned payload of an ordinary allocated block, handed over to objects
+ * of a single size.  Objects carry no header: sf_free finds the page by masking the pointer,
+ * recognises it as a slab page from the arena's slabMap, and reads the object size from here.
+ */
+typedef struct sf_slab {
+    struct sf_slab* next; //partial slabs of the same class
+    struct sf_slab* prev;
+    size_t objSize; //0 for a compact page, see sf_cpage
+    int count; //objects in the page
+    int freeCount; //objects not handed out
+    uint64_t freeMap[4]; //bit set = slot free, enough for (PAGE_SZ - SLAB_HDR) / 16 slots
+} sf_slab;
+
+static size_t slabMax = SF_SLAB_MAX;
+
+/*
+ * A compact page is a slab page split into blocks of any size instead of slots of one.  Every
+ * offset in it fits in 32 bits, so a block has a 4 byte header (payload << 16 | size | alloc 0x8 |
+ * prev alloc 0x4 | queued 0x1) right in front of its payload, and a free block links to the
+ * others by their offsets from the page and ends in a 4 byte footer: the smallest block is 16
+ * bytes where the heap's is 32.  Blocks start 4 bytes short of a 16 byte boundary, so that every
+ * payload is aligned, and an allocated epilogue header closes the page.
+ */
+typedef struct sf_cpage {
+    struct sf_cpage* next; //compact pages with a free block
+    struct sf_cpage* prev;
+    size_t objSize; //always 0, where a slab page keeps its object size
+    uint32_t freeList; //offset of the first free block, 0 if there is none
+    uint32_t freeBytes; //size of the free blocks together
+} sf_cpage;
+
+static size_t compactMax = SF_COMPACT_MAX;
+
+static int freePolicy = SF_POLICY;
+
+static size_t hugeThreshold = SF_MMAP_THRESHOLD;
+
+static size_t trimThreshold = SF_TRIM_THRESHOLD;
+
+static size_t growMin = SF_GROW_MIN;
+static size_t growMax = SF_GROW_MAX;
+
+static int thp = SF_THP;
+
+static int remoteFree = SF_REMOTE_FREE;
+
+static size_t tcacheLimit = SF_TCACHE_BYTES;
+static __thread tcache threadCache;
+static sf_block tcacheKey;
+static pthread_key_t tcacheExitKey;
+static pthread_once_t tcacheOnce = PTHREAD_ONCE_INIT;
+
+static void arena_init_all() {
+    for(int i = 1; i < SF_MAX_ARENAS; i++) {
+        pthread_mutex_init(&arenas[i].lock, NULL);
+        arenas[i].heads = arenas[i].ownHeads;
+    }
+
+    //aligned to a huge page, which every arena's slice then starts on
+    size_t len = (SF_MAX_ARENAS - 1) * SF_ARENA_RESERVE;
+    char* base = mmap(NULL, len + THP_SZ, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(base != MAP_FAILED) { //otherwise every thread shares arena 0
+        char* aligned = (char*) (((uintptr_t) base + THP_SZ - 1) & ~(THP_SZ - 1));
+        if(aligned > base) {
+            munmap(base, aligned - base);
+        }
+        if(base + THP_SZ > aligned) {
+            munmap(aligned + len, base + THP_SZ - aligned);
+        }
+        arenaBase = aligned;
+    }
+}
+
+//Arena the calling thread allocates from
+static sf_arena* thread_arena() {
+    pthread_once(&arenaOnce, arena_init_all);
+    if(arenaBase == NULL) {
+        return &arenas[0];
+    }
+
+    if(arenaPolicy == SF_ARENA_BY_CPU) {
+        int cpu = sched_getcpu();
+        return &arenas[(cpu < 0 ? 0 : cpu) % arenaCount];
+    }
+
+    if(threadArena == NULL) {
+        threadArena = &arenas[__atomic_fetch_add(&nextArena, 1, __ATOMIC_RELAXED) % arenaCount];
+    }
+    return threadArena;
+}
+
+//Arena whose heap contains ptr
+static sf_arena* arena_of(void* ptr) {
+    char* addr = (char*) ptr;
+    if(arenaBase != NULL && addr >= arenaBase && addr < arenaBase + (SF_MAX_ARENAS - 1) * SF_ARENA_RESERVE) {
+        return &arenas[1 + (addr - arenaBase) / SF_ARENA_RESERVE];
+    }
+    return &arenas[0];
+}
+
+/*
+ * Add *len bytes, a multiple of PAGE_SZ, to the end of an arena's heap, returns the start of the
+ * new space or NULL when out of memory.  sf_mem_grow hands out one page per call, so arena 0 may
+ * come up short, in which case *len is set to what it did get.  Under sf_thp the other arenas
+ * grow up to the next huge page boundary instead, and *len is set to that.
+ */
+static void* arena_grow(sf_arena* arena, size_t* len) {
+    if(arena == &arenas[0]) {
+        void* start = sf_mem_grow();
+        if(start == NULL) {
+            return NULL;
+        }
+        size_t got = PAGE_SZ;
+        while(got < *len && sf_mem_grow() != NULL) {
+            got += PAGE_SZ;
+        }
+        *len = got;
+        return start;
+    }
+
+    char* start = arenaBase + (arena - arenas - 1) * SF_ARENA_RESERVE;
+    if(arena->brk == NULL) {
+        arena->brk = start;
+    }
+    if(thp && *len <= (size_t) (start + SF_ARENA_RESERVE - (char*) arena->brk)) {
+        char* to = (char*) (((uintptr_t) arena->brk + *len + THP_SZ - 1) & ~(THP_SZ - 1));
+        if(to <= start + SF_ARENA_RESERVE) {
+            *len = to - (char*) arena->brk;
+        }
+    }
+    if(*len > (size_t) (start + SF_ARENA_RESERVE - (char*) arena->brk) ||
+       mprotect(arena->brk, *len, PROT_READ | PROT_WRITE) != 0) {
+        return NULL;
+    }
+    if(thp) { //a kernel without transparent huge pages keeps using small ones
+        madvise(arena->brk, *len, MADV_HUGEPAGE);
+    }
+
+    void* page = arena->brk;
+    arena->brk += *len;
+    return page;
+}
+
+//Bytes to grow a heap by when it is need bytes short: the heap size, clamped to growMin and
+//growMax, or need itself if that is more, in whole pages
+static size_t grow_size(sf_arena* arena, size_t need) {
+    size_t chunk = arena->heapSize < growMin ? growMin : arena->heapSize;
+    if(chunk > growMax) {
+        chunk = growMax;
+    }
+    if(chunk < need) {
+        chunk = need;
+    }
+    return (chunk + PAGE_SZ - 1) & ~((size_t) PAGE_SZ - 1);
+}
+
+//Bytes the heap is short of for the block at its end to hold size bytes
+static size_t heap_shortfall(sf_arena* arena, size_t size) {
+    size_t last = (arena->epilogue->header & 0x4) != 0 ? 0 : arena->epilogue->prev_footer & MAX_BLK_SIZE;
+    return size > last ? size - last : 0;
+}
+
+static void* arena_end(sf_arena* arena) {
+    return arena == &arenas[0] ? sf_mem_end() : arena->brk;
+}
+
+/*
+ * Move the arena's fresh mark past an allocated block.  Memory past the mark has not been handed
+ * out since it was mapped, so it is still zero apart from the header and links of the free block
+ * that starts at or before it; coalesce clears the headers it merges away.
+ */
+static void mark_used(sf_arena* arena, sf_block* block) {
+    char* end = (char*) block + (block->header & MAX_BLK_SIZE);
+    if(arena->fresh != NULL && end > arena->fresh) {
+        arena->fresh = end;
+    }
+}
 
 static size_t pad(size_t size) {
-    size_t padded = size;
-    if(padded % 16 != 0) padded += 16 - (size % 16); //make it multiple of 16 bytes, 0-15 will be 16, 17-31 will be 32
-    padded += 16; //header & footer
-    return padded;
+    size_t padded = size + BLK_OVERHEAD; //header & footer, or the header alone without SF_FOOTERS
+    if(padded % 16 != 0) padded += 16 - (padded % 16); //make it multiple of 16 bytes
+    return padded < 32 ? 32 : padded;
+}
+
+/*
+ * Copy an allocated block's header to its footer, a row that is payload instead without SF_FOOTERS.
+ * Only whoever allocates, frees or caches the block writes it: a neighbour freed or split under the
+ * lock flips the prv alloc bit in the header alone, since the block may sit in a thread cache whose
+ * owner is rewriting its footer without the lock.  Nothing reads an allocated block's footer, a
+ * footer is only looked at once the prv alloc bit of the block after it says it is free.
+ */
+static void alloc_footer(sf_block* block, sf_header header) {
+#if SF_FOOTERS
+    ((sf_block*) ((void*) block + (header & MAX_BLK_SIZE)))->prev_footer = header;
+#endif
 }
 
 static int getIdx(size_t size) {
@@ -35,7 +428,7 @@ static int getIdx(size_t size) {
     return idx;
 }
 
-static int isInvalidPointer(void* ptr) {
+static int isInvalidPointer(sf_arena* arena, void* ptr) {
     sf_block* block = (sf_block*) (ptr - (size_t)16);
     sf_header header = block->header;
     size_t blockSize = (header & MAX_BLK_SIZE);
@@ -46,12 +439,12 @@ static int isInvalidPointer(void* ptr) {
     }
 
     //block not contained b/w prologue & epilogue (the boundary blocks)
-    if(block < prologue || block > epilogue) {
+    if(block < arena->prologue || block > arena->epilogue) {
         return 1;
     }
 
-    //freeing un-allocated block
-    if((header & 0x8) == 0) {
+    //freeing un-allocated block, or one a remote free has already queued for its arena
+    if((header & 0x8) == 0 || (header & 0x1) != 0) {
         return 1;
     }
 
@@ -67,26 +460,105 @@ static int isInvalidPointer(void* ptr) {
     return 0;
 }
 
-static void initialize_free_list() {
+/*
+ * TLSF list of a block size: first level class 0 covers sizes below TLSF_SMALL in 16 byte steps,
+ * above that the first level is the power of 2 at or below the size and the second level the
+ * next TLSF_SL_LOG bits.  The lists are numbered first level * TLSF_SL + second level.
+ */
+static int tlsf_index(size_t size) {
+    if(size < TLSF_SMALL) {
+        return size >> 4;
+    }
+    int log = 63 - __builtin_clzl(size);
+    return (log - 7) * TLSF_SL + ((size >> (log - TLSF_SL_LOG)) & (TLSF_SL - 1));
+}
+
+//Sentinel of free list idx under the arena's policy
+static sf_block* list_head(sf_arena* arena, int idx) {
+    return arena->policy == SF_POLICY_TLSF ? &arena->tlsfHeads[idx] : &arena->heads[idx];
+}
+
+//Index of the first non-empty free list at or after idx under the arena's policy, -1 if none
+static int next_list(sf_arena* arena, int idx) {
+    if(arena->policy == SF_POLICY_TLSF) {
+        int fl = idx / TLSF_SL;
+        unsigned int slMap = fl < TLSF_FL ? arena->tlsfSl[fl] & (~0U << (idx % TLSF_SL)) : 0;
+        if(slMap == 0) { //nothing left in this first level class, take the next non-empty one
+            unsigned int flMap = fl + 1 < TLSF_FL ? arena->tlsfFl & (~0U << (fl + 1)) : 0;
+            if(flMap == 0) {
+                return -1;
+            }
+            fl = __builtin_ctz(flMap);
+            slMap = arena->tlsfSl[fl];
+        }
+        return fl * TLSF_SL + __builtin_ctz(slMap);
+    }
+
+    unsigned int lists = idx < NUM_FREE_LISTS ? arena->nonEmpty & ~((1U << idx) - 1) : 0;
+    return lists == 0 ? -1 : __builtin_ctz(lists);
+}
+
+static void initialize_free_list(sf_arena* arena) {
+    arena->policy = freePolicy;
+    if(arena->policy == SF_POLICY_TLSF && arena->tlsfHeads == NULL) {
+        void* heads = mmap(NULL, TLSF_LISTS * sizeof(sf_block), PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(heads == MAP_FAILED) { //no room for the sentinels, fall back to the Fibonacci lists
+            arena->policy = SF_POLICY_SEGREGATED;
+        } else {
+            arena->tlsfHeads = (sf_block*) heads;
+        }
+    }
+
+    arena->nonEmpty = 0;
     for(int i=0; i<NUM_FREE_LISTS; i++) {
-        sf_free_list_heads[i].body.links.next = &sf_free_list_heads[i];
-        sf_free_list_heads[i].body.links.prev = &sf_free_list_heads[i];
+        arena->heads[i].body.links.next = &arena->heads[i];
+        arena->heads[i].body.links.prev = &arena->heads[i];
+    }
+
+    arena->tlsfFl = 0;
+    memset(arena->tlsfSl, 0, sizeof(arena->tlsfSl));
+    if(arena->policy == SF_POLICY_TLSF) {
+        for(int i = 0; i < TLSF_LISTS; i++) {
+            arena->tlsfHeads[i].body.links.next = &arena->tlsfHeads[i];
+            arena->tlsfHeads[i].body.links.prev = &arena->tlsfHeads[i];
+        }
     }
 }
 
-static void remove_block(sf_block* block) {
+static void remove_block(sf_arena* arena, sf_block* block) {
     sf_block* prev = block->body.links.prev;
     sf_block* next = block->body.links.next;
 
     prev->body.links.next = next;
     next->body.links.prev = prev;
+    if(prev == next) { //only the sentinel is left
+        if(arena->policy == SF_POLICY_TLSF) {
+            int idx = prev - arena->tlsfHeads;
+            arena->tlsfSl[idx / TLSF_SL] &= ~(1U << (idx % TLSF_SL));
+            if(arena->tlsfSl[idx / TLSF_SL] == 0) {
+                arena->tlsfFl &= ~(1U << (idx / TLSF_SL));
+            }
+        } else {
+            arena->nonEmpty &= ~(1U << (prev - arena->heads));
+        }
+    }
 }
 
-static void insert_free_list(sf_block* block) {
+static void insert_free_list(sf_arena* arena, sf_block* block) {
     size_t blockSize = block->header & MAX_BLK_SIZE;
-    int idx = getIdx(blockSize);
-    if(idx > NUM_FREE_LISTS - 2) idx = NUM_FREE_LISTS - 1;
-    sf_block* sentinel = &sf_free_list_heads[idx];
+    sf_block* sentinel;
+    if(arena->policy == SF_POLICY_TLSF) {
+        int idx = tlsf_index(blockSize);
+        sentinel = &arena->tlsfHeads[idx];
+        arena->tlsfSl[idx / TLSF_SL] |= 1U << (idx % TLSF_SL);
+        arena->tlsfFl |= 1U << (idx / TLSF_SL);
+    } else {
+        int idx = getIdx(blockSize);
+        if(idx > NUM_FREE_LISTS - 2) idx = NUM_FREE_LISTS - 1;
+        sentinel = &arena->heads[idx];
+        arena->nonEmpty |= 1U << idx;
+    }
 
     //If empty free list
     if(sentinel == sentinel->body.links.next && sentinel == sentinel->body.links.prev) {
@@ -104,37 +576,58 @@ static void insert_free_list(sf_block* block) {
     }
 }
 
-static void* search_free_list(int idx, size_t size) {
-    sf_block* allocated = NULL;
-    for(int i = idx; i<NUM_FREE_LISTS - 1; i++) {
-        if(&sf_free_list_heads[i] == sf_free_list_heads[i].body.links.next && &sf_free_list_heads[i] == sf_free_list_heads[i].body.links.prev) { 
-            //free list is empty
-            continue;
-        } else {
-            sf_block* sentinal = &sf_free_list_heads[i];
-            sf_block* current = sentinal->body.links.next;
-            while(current != sentinal) { //While list has not been fully looked
-                sf_header header = current->header;
-                header = header & MAX_BLK_SIZE;
-                if(header >= size) { //block found
-                    allocated = current;
-                    // remove_block(allocated);
-                    break;
-                } else {
-                    current = current->body.links.next; //keep traversing this list
-                }
+static void* search_free_list(sf_arena* arena, int idx, size_t size) {
+    STAT(size_t walked = 0);
+    //non-empty lists from idx up to, but not including, the wilderness list
+    unsigned int lists = arena->nonEmpty & ~((1U << idx) - 1) & ((1U << (NUM_FREE_LISTS - 1)) - 1);
+    while(lists != 0) {
+        int i = __builtin_ctz(lists);
+        sf_block* sentinal = &arena->heads[i];
+        sf_block* current = sentinal->body.links.next;
+        while(current != sentinal) { //While list has not been fully looked
+            STAT(walked++);
+            if((current->header & MAX_BLK_SIZE) >= size) { //block found
+                STAT(arena->stats.classes[idx].search_nodes += walked);
+                return current;
             }
+            current = current->body.links.next; //keep traversing this list
         }
+        lists &= lists - 1;
+    }
+
+    STAT(arena->stats.classes[idx].search_nodes += walked);
+    return NULL;
+}
+
+//First block of the first TLSF list whose every block holds size bytes, NULL if none is non-empty
+static sf_block* tlsf_search(sf_arena* arena, size_t size) {
+    if(size >= TLSF_SMALL) { //round up to the next list boundary, smaller lists are all exact
+        size += ((size_t) 1 << (63 - __builtin_clzl(size) - TLSF_SL_LOG)) - 1;
+    }
+    int idx = size > MAX_BLK_SIZE ? -1 : next_list(arena, tlsf_index(size));
+    return idx < 0 ? NULL : arena->tlsfHeads[idx].body.links.next;
+}
+
+//Put the free block at the end of the heap on the wilderness list, or its TLSF list
+static void insert_wilderness(sf_arena* arena, sf_block* block) {
+    if(arena->policy == SF_POLICY_TLSF) {
+        insert_free_list(arena, block);
+        return;
     }
 
-    return (void*) allocated;
+    sf_block* sentinel = &arena->heads[NUM_FREE_LISTS - 1];
+    arena->nonEmpty |= 1U << (NUM_FREE_LISTS - 1);
+    sf_block* next = sentinel->body.links.next;
+    block->body.links.next = next;
+    block->body.links.prev = sentinel;
+    sentinel->body.links.next = block;
+    next->body.links.prev = block;
 }
 
 static void* coalesce(sf_block* a, sf_block* b) {
     sf_block* block = a;
     size_t blockSize = (a->header & MAX_BLK_SIZE) + (b->header & MAX_BLK_SIZE);
 
-    block->prev_footer = a->prev_footer; //seems redundant
     block->header = blockSize | (a->header & 0x4); //new block header with new size of a + b, and copy over pAlloc bit
 
     sf_block* next = (sf_block*) ((void*) block + blockSize);
@@ -145,15 +638,15 @@ static void* coalesce(sf_block* a, sf_block* b) {
     return block;
 }
 
-static void* split(sf_block* block, size_t sizeA, size_t payload) {
+static void* split(sf_arena* arena, sf_block* block, size_t sizeA, size_t payload) {
     sf_block* nextBlock = (sf_block*) ((void*) block + (size_t) (block->header & MAX_BLK_SIZE));
     size_t blockSize = block->header & MAX_BLK_SIZE;
     size_t sizeB = blockSize - sizeA;
     if(sizeB >= 32 && sizeB % 16 == 0) {
+        STAT(arena->stats.classes[getIdx(blockSize)].splits++);
         //a is first split block, b is second split block, block = a + b*
         //header of a, footer of a which is prev footer in b
         sf_header headerA = (payload << 32) | sizeA | (1 << 3) | (block->header & 0x4);
-        sf_footer footerA = (payload << 32) | sizeA | (1 << 3) | (block->header & 0x4);
         sf_block* a = block;
         a->header = headerA;
 
@@ -162,250 +655,2827 @@ static void* split(sf_block* block, size_t sizeA, size_t payload) {
         sf_footer footerB = sizeB | (1 << 2);
         sf_block* b = (sf_block*) ((void*) block + (size_t)(sizeA));
         b->header = headerB;
-        b->prev_footer = footerA;
+        alloc_footer(a, headerA);
         nextBlock->prev_footer = footerB;
 
-        nextBlock->header = (nextBlock->header >> 3) << 3; //Clear out previous allocation bit
-
-        if(nextBlock != epilogue) {
-            sf_block* nextNextBlock = (sf_block*) ((void*) nextBlock + (nextBlock->header & MAX_BLK_SIZE));
-            nextNextBlock->prev_footer = nextBlock->header;
+        __atomic_fetch_and(&nextBlock->header, ~(sf_header) 0x6, __ATOMIC_RELAXED); //Clear out previous allocation bit, the next block may be cached or queued
 
-            if((nextBlock->header & 0x8) == 0) { //if next block is free, coalesce both
-                remove_block(nextBlock);
-                b = (sf_block*) coalesce(b, nextBlock);
-            }
+        if(nextBlock != arena->epilogue && (nextBlock->header & 0x8) == 0) { //if next block is free, coalesce both
+            remove_block(arena, nextBlock);
+            b = (sf_block*) coalesce(b, nextBlock);
+            STAT(arena->stats.classes[getIdx(b->header & MAX_BLK_SIZE)].coalesces++);
         }
 
-        insert_free_list(b);
+        insert_free_list(arena, b);
         return a;
     }
 
-    block->header |= (payload << 32);
-    block->header |= 0x8;
-    nextBlock->prev_footer |= (payload << 32);
-    nextBlock->prev_footer |= 0x8;
-    nextBlock->header |= 0x4;
+    block->header = (payload << 32) | (block->header & (MAX_BLK_SIZE | 0x4)) | 0x8; //realloc passes in a block that already has a payload
+    alloc_footer(block, block->header);
+    __atomic_fetch_or(&nextBlock->header, 0x4, __ATOMIC_RELAXED); //the next block may be cached, see set_payload
     return block; //Split not possible
 }
 
 //Set up prologue, wilderness, and epilogue blocks, put wilderness in free list
-static void heap_setup() {
-    prologue = (sf_block*) sf_mem_grow();
-    heapSize += PAGE_SZ;
+static int heap_setup(sf_arena* arena) {
+    size_t len = grow_size(arena, PAGE_SZ);
+    sf_block* prologue = (sf_block*) arena_grow(arena, &len);
+    if(prologue == NULL) {
+        sf_errno = ENOMEM;
+        return -1;
+    }
+    arena->prologue = prologue;
+    arena->heapSize += len;
     prologue->header = 0x28; //size 32 and allocated
-    sf_block* block = (sf_block*) (sf_mem_start() + 32);
+    sf_block* block = (sf_block*) ((void*) prologue + 32);
     block->prev_footer = 0x28;
-    block->header = 0xfd4;
-    epilogue = (sf_block*) (sf_mem_end() - 16);
-    epilogue->prev_footer = 0xfd4;
+    block->header = (len - 48) | 0x4; //all but the prologue, the epilogue and the unused row
+    sf_block* epilogue = (sf_block*) (arena_end(arena) - 16);
+    arena->epilogue = epilogue;
+    epilogue->prev_footer = block->header;
     epilogue->header = 0x8;
+    arena->fresh = arena == &arenas[0] ? NULL : (char*) block; //sf_mem_grow takes its pages from malloc
 
-    sf_block* sentinel = &sf_free_list_heads[NUM_FREE_LISTS - 1];
-    sentinel->body.links.next = block;
-    sentinel->body.links.prev = block;
-    block->body.links.next = sentinel;
-    block->body.links.prev = sentinel;
+    insert_wilderness(arena, block);
+    return 0;
 }
 
-static void heap_extend() {
-    sf_block* block = (sf_block*) sf_mem_grow();
+/*
+ * Grow the heap by at least need bytes in one step, rounded up and possibly enlarged by the
+ * growth policy, and merge the new space into the free block at its end.  Returns 0, or -1 with
+ * sf_errno set to ENOMEM if the heap could not grow by need (whatever it did grow by is kept).
+ */
+static int heap_extend(sf_arena* arena, size_t need) {
+    size_t len = grow_size(arena, need);
+    sf_block* block = (sf_block*) arena_grow(arena, &len);
     if(block == NULL) {
         //Allocation failed
         sf_errno = ENOMEM;
-        return;
+        return -1;
     }
 
     //Update heap size, format the block
-    heapSize += PAGE_SZ;
+    arena->heapSize += len;
+    STAT(arena->stats.extensions++);
 
     //prevBlock footer & old epilogue header
+    sf_block* epilogue = arena->epilogue;
     sf_footer prevFooter = epilogue->prev_footer;
     sf_header epiHeader = epilogue->header;
 
-    block = epilogue; //New block actually starts from old epilogue
-    block->prev_footer = prevFooter;
-    block->header = PAGE_SZ | epiHeader;
+    block = epilogue; //New block actually starts from old epilogue, its prev_footer already in place
+    block->header = len | (epiHeader & 0x4); //the new space is free, whatever the epilogue was
 
     //create new epilogue
-    epilogue = (sf_block*) (sf_mem_end() - 16);
+    epilogue = (sf_block*) (arena_end(arena) - 16);
+    arena->epilogue = epilogue;
     epilogue->prev_footer = block->header;
-    epilogue->header = epiHeader;
+    epilogue->header = 0x8; //allocated, with the block before it free
 
     //check if previous last block was free or not, if free merge
     if((block->header & 0x4) == 0) { //free
         size_t blkSize = prevFooter & MAX_BLK_SIZE;
         sf_block* prev = (sf_block*) ((void*) block - blkSize);
-        remove_block(prev);
+        remove_block(arena, prev);
         block = (sf_block*) coalesce(prev, block);
+        STAT(arena->stats.classes[getIdx(block->header & MAX_BLK_SIZE)].coalesces++);
     }
 
-    sf_block* sentinel = &sf_free_list_heads[NUM_FREE_LISTS - 1];
-    sf_block* next = sentinel->body.links.next;
-    block->body.links.next = next;
-    block->body.links.prev = sentinel;
-    sentinel->body.links.next = block;
-    next->body.links.prev = block;
+    insert_wilderness(arena, block);
+    if(len < need) {
+        sf_errno = ENOMEM;
+        return -1;
+    }
+    return 0;
 }
 
-void *sf_malloc(size_t size) {
-    if(size == 0) { //Empty request
-        return NULL;
+//Allocate a block of padded size sizeP holding payload bytes from an arena, arena->lock held
+static sf_block* heap_malloc(sf_arena* arena, size_t sizeP, size_t payload) {
+    if(arena->listEmpty == 0) {
+        initialize_free_list(arena);
+        if(heap_setup(arena) != 0) {
+            return NULL;
+        }
+        arena->listEmpty = 1;
     }
 
-    if(listEmpty == 0) {
-        initialize_free_list();
-        heap_setup();
-        listEmpty = 1;
+    sf_block* allocated;
+    int idx = getIdx(sizeP);
+    STAT(arena->stats.classes[idx].searches++);
+    if(arena->policy == SF_POLICY_TLSF) {
+        allocated = tlsf_search(arena, sizeP);
+        STAT(arena->stats.classes[idx].search_nodes += allocated != NULL);
+    } else {
+        allocated = (sf_block*) search_free_list(arena, idx, sizeP);
+        if(allocated == NULL) {
+            //Check wilderness region, which large free blocks share with the wilderness block
+            sf_block* sentinel = &arena->heads[NUM_FREE_LISTS - 1];
+            allocated = sentinel->body.links.next;
+            while(allocated != sentinel && (allocated->header & MAX_BLK_SIZE) < sizeP) {
+                STAT(arena->stats.classes[idx].search_nodes++);
+                allocated = allocated->body.links.next;
+            }
+            if(allocated == sentinel) {
+                allocated = NULL;
+            } else {
+                STAT(arena->stats.classes[idx].search_nodes++);
+            }
+        }
     }
 
-    size_t sizeP = pad(size);
-    sf_block* allocated = (sf_block*) search_free_list(getIdx(sizeP), sizeP);
-
-    //Check wilderness region
+    //nothing fits, extend the heap in one step so that the free block at its end does
     if(allocated == NULL) {
-        //Check if heap is empty, then extend heap. Afterwards continue extending until allocation block successfully done so
-        sf_block* sentinel = &sf_free_list_heads[NUM_FREE_LISTS - 1];
-        if(sentinel == sentinel->body.links.next && sentinel == sentinel->body.links.prev) {
-            heap_extend();
-            if(sf_errno == ENOMEM) {
-                return NULL;
-            }
+        size_t shortfall = heap_shortfall(arena, sizeP); //0 if the last block fits after all
+        if(shortfall != 0 && heap_extend(arena, shortfall) != 0) {
+            STAT(arena->stats.failed++);
+            return NULL;
+        }
+        allocated = (sf_block*) ((void*) arena->epilogue - (arena->epilogue->prev_footer & MAX_BLK_SIZE));
+    }
+
+    //if possible to split, split it + insert_free_list remainder
+    remove_block(arena, allocated);
+    allocated = (sf_block*) split(arena, allocated, sizeP, payload);
+    //for statistics
+    sf_header header = allocated->header;
+    size_t payloadSize = header >> 32; //get payload size
+    arena->currPayload += payloadSize;
+    size_t blockSize = header & MAX_BLK_SIZE;
+    arena->memUsed += blockSize;
+    STAT(arena->stats.classes[getIdx(blockSize)].mallocs++);
+    if(arena->currPayload > arena->maxPayload) {
+        arena->maxPayload = arena->currPayload;
+    }
+    mark_used(arena, allocated);
+
+    return allocated;
+}
+
+/*
+ * Grow an allocated block to size bytes without moving it, by taking over the free block after
+ * it and extending the heap when that brings it to the epilogue.  Whatever is left over beyond
+ * size is split off again.  Returns 0 on success, -1 if the block has to move, arena->lock held.
+ */
+static int grow_in_place(sf_arena* arena, sf_block* block, size_t size, size_t payload) {
+    sf_header header = block->header;
+    size_t blockSize = header & MAX_BLK_SIZE;
+    sf_block* next = (sf_block*) ((void*) block + blockSize);
+    size_t avail = blockSize;
+    sf_block* after = next;
+    if(next != arena->epilogue && (next->header & 0x8) == 0) {
+        avail += next->header & MAX_BLK_SIZE;
+        after = (sf_block*) ((void*) next + (next->header & MAX_BLK_SIZE));
+    }
+    if(avail < size && after != arena->epilogue) {
+        return -1; //an allocated block is in the way
+    }
+
+    if(avail < size) { //the free block after ours is the wilderness, or about to become it
+        int err = sf_errno;
+        if(heap_extend(arena, size - avail) != 0) {
+            sf_errno = err; //moving the block elsewhere may still work
+            return -1;
         }
+        avail = blockSize + (next->header & MAX_BLK_SIZE);
+    }
+
+    if(avail > blockSize) {
+        remove_block(arena, next);
+    }
+    arena->memUsed -= blockSize;
+    arena->currPayload -= header >> 32;
+    block->header = avail | (header & 0xF);
+    block = (sf_block*) split(arena, block, size, payload);
+    arena->memUsed += block->header & MAX_BLK_SIZE;
+    arena->currPayload += payload;
+    if(arena->currPayload > arena->maxPayload) {
+        arena->maxPayload = arena->currPayload;
+    }
+    mark_used(arena, block);
+    return 0;
+}
+
+//Bytes to skip at the front of a free block so the payload after them is aligned, 0 or a whole block
+static size_t aligned_slack(sf_block* block, size_t align) {
+    size_t slack = -(uintptr_t) block->body.payload & (align - 1);
+    while(slack != 0 && slack < 32) {
+        slack += align;
+    }
+    return slack;
+}
 
-        allocated = (sf_block*) sf_free_list_heads[NUM_FREE_LISTS - 1].body.links.next;
-        size_t allocatedBLKSize = allocated->header & MAX_BLK_SIZE;
-        while((void*) allocated + allocatedBLKSize != epilogue && allocatedBLKSize < sizeP) {
-            allocated = allocated->body.links.next;
-            allocatedBLKSize = allocated->header & MAX_BLK_SIZE;
+//Allocate a block of padded size sizeP whose payload is aligned to align (a power of 2), arena->lock held
+static sf_block* heap_memalign(sf_arena* arena, size_t align, size_t sizeP, size_t payload) {
+    if(arena->listEmpty == 0) {
+        initialize_free_list(arena);
+        if(heap_setup(arena) != 0) {
+            return NULL;
         }
+        arena->listEmpty = 1;
+    }
 
-        while(allocatedBLKSize < sizeP) { //continuously extend heap until large allocation request met
-            heap_extend();
-            if(sf_errno == ENOMEM) {
-                return NULL;
+    sf_block* block = NULL;
+    int first = arena->policy == SF_POLICY_TLSF ? tlsf_index(sizeP) : getIdx(sizeP);
+    for(int i = next_list(arena, first); i >= 0 && block == NULL; i = next_list(arena, i + 1)) {
+        sf_block* sentinel = list_head(arena, i);
+        for(sf_block* current = sentinel->body.links.next; current != sentinel; current = current->body.links.next) {
+            if(aligned_slack(current, align) + sizeP <= (current->header & MAX_BLK_SIZE)) {
+                block = current;
+                break;
             }
-
-            allocatedBLKSize += PAGE_SZ;
         }
     }
 
-    //Allocation not successful
-    if(allocated == NULL) {
-        sf_errno = ENOMEM;
-        return NULL;
-    } else {
-        //if possible to split, split it + insert_free_list remainder
-        remove_block(allocated);
-        allocated = (sf_block*) split(allocated, sizeP, size);
-        //for statistics
-        sf_header header = allocated->header;
-        size_t payload = header >> 32; //get payload size
-        currPayload += payload;
-        size_t blockSize = header & MAX_BLK_SIZE;
-        memUsed += blockSize;
-        if(currPayload > maxPayload) {
-            maxPayload = currPayload;
+    //grow the wilderness until an aligned block fits at its end, the slack is below align + 32
+    while(block == NULL) {
+        if(heap_extend(arena, heap_shortfall(arena, sizeP + align + 16)) != 0) {
+            STAT(arena->stats.failed++);
+            return NULL;
+        }
+        block = (sf_block*) ((void*) arena->epilogue - (arena->epilogue->prev_footer & MAX_BLK_SIZE));
+        if(aligned_slack(block, align) + sizeP > (block->header & MAX_BLK_SIZE)) {
+            block = NULL;
         }
     }
 
-    return allocated->body.payload;
-}
+    remove_block(arena, block);
+    size_t slack = aligned_slack(block, align);
+    if(slack != 0) {
+        //leading slack becomes a free block of its own, the rest starts right after it
+        size_t blockSize = block->header & MAX_BLK_SIZE;
+        block->header = slack | (block->header & 0x4);
+        sf_block* rest = (sf_block*) ((void*) block + slack);
+        rest->prev_footer = block->header;
+        rest->header = blockSize - slack;
+        ((sf_block*) ((void*) rest + (blockSize - slack)))->prev_footer = rest->header;
+        insert_free_list(arena, block);
+        block = rest;
+    }
 
-void sf_free(void *pp) {
-    if(pp == NULL || isInvalidPointer(pp)) {
-        abort();
+    block = (sf_block*) split(arena, block, sizeP, payload);
+    arena->currPayload += payload;
+    arena->memUsed += block->header & MAX_BLK_SIZE;
+    STAT(arena->stats.classes[getIdx(block->header & MAX_BLK_SIZE)].mallocs++);
+    if(arena->currPayload > arena->maxPayload) {
+        arena->maxPayload = arena->currPayload;
     }
+    mark_used(arena, block);
+    return block;
+}
 
-    sf_block* block = (sf_block*) (pp - 16);
+//Return an allocated block to its arena's free lists, coalescing with its neighbours, arena->lock held
+static void heap_free(sf_arena* arena, sf_block* block) {
     sf_header header = block->header;
     size_t blockSize = header & MAX_BLK_SIZE;
 
-    memUsed -= blockSize; //allocated memory decreases
-    currPayload -= header >> 32; //less payload in circulation
+    arena->memUsed -= blockSize; //allocated memory decreases
+    arena->currPayload -= header >> 32; //less payload in circulation
+    STAT(arena->stats.classes[getIdx(blockSize)].frees++);
 
     //clear allocation bit in current block both in header & footer, pal of next block
     size_t prevAlloc = (header & 0x4) >> 2;
     block->header = (header & MAX_BLK_SIZE) | (prevAlloc << 2);
     sf_block* next = (sf_block*) ((void*) block + blockSize);
-    next->header &= 0xFFFFFFFFFFFFFFF8;
+    __atomic_fetch_and(&next->header, ~(sf_header) 0x6, __ATOMIC_RELAXED); //next may be cached or queued, see set_payload
     next->prev_footer = block->header;
 
-    if(next != epilogue) {
-        //make footer of next block same as header
-        sf_block* nextNext = (sf_block*) ((void*) next + (next->header & MAX_BLK_SIZE));
-        nextNext->prev_footer = next->header;
-    }
-
     //If previous block in heap is free, coalesce with previous block
     if(prevAlloc == 0) {
         size_t prevBlockSize = block->prev_footer & MAX_BLK_SIZE;
         sf_block* prev = (sf_block*) ((void*) block - prevBlockSize);
-        if(prev > prologue) {
-            remove_block(prev);
+        if(prev > arena->prologue) {
+            remove_block(arena, prev);
             block = (sf_block*) coalesce(prev, block);
+            STAT(arena->stats.classes[getIdx(block->header & MAX_BLK_SIZE)].coalesces++);
         }
     }
 
     //If next block is not epilogue & it is free block
-    if(next < epilogue && (next->header & 0x8) == 0) {
-        remove_block(next);
+    if(next < arena->epilogue && (next->header & 0x8) == 0) {
+        remove_block(arena, next);
         block = (sf_block*) coalesce(block, next);
+        STAT(arena->stats.classes[getIdx(block->header & MAX_BLK_SIZE)].coalesces++);
     }
 
-    insert_free_list(block);
+    insert_free_list(arena, block);
 }
 
-void *sf_realloc(void *pp, size_t rsize) {
-    if(isInvalidPointer(pp)) {
-        sf_errno = EINVAL;
-        abort();
+/*
+ * Trimming hands pages inside free blocks back to the OS.  Only whole pages past a block's
+ * header and links and before its footer are given up, whole huge pages under sf_thp, so every boundary tag stays intact and
+ * the pages come back, zeroed or as they were, when they are next touched.  A free block whose
+ * pages have all been handed back has 0x2 set in its header and footer; any rewrite of the header
+ * clears it again.
+ */
+static size_t trim_unit(sf_arena* arena) {
+    return thp && arena != &arenas[0] ? THP_SZ : PAGE_SZ; //handing back part of a huge page splits it
+}
+
+static size_t release_block(sf_arena* arena, sf_block* block) {
+    size_t size = block->header & MAX_BLK_SIZE;
+    size_t unit = trim_unit(arena);
+    uintptr_t from = ((uintptr_t) block + 32 + unit - 1) & ~((uintptr_t) unit - 1);
+    uintptr_t to = ((uintptr_t) block + size) & ~((uintptr_t) unit - 1);
+    if((block->header & 0x2) != 0 || from >= to || madvise((void*) from, to - from, SF_TRIM_ADVICE) != 0) {
+        return 0;
     }
 
-    if(rsize == 0) {
-        sf_free(pp);
+    block->header |= 0x2;
+    ((sf_block*) ((void*) block + size))->prev_footer = block->header;
+    return to - from;
+}
+
+//Cut the free block at the top of the heap down to keep bytes and give up the pages after it, arena->lock held
+static size_t trim_top(sf_arena* arena, size_t keep) {
+    if(arena->listEmpty == 0 || (arena->epilogue->header & 0x4) != 0) {
+        return 0; //no heap yet, or nothing free at its top
+    }
+    sf_block* block = (sf_block*) ((void*) arena->epilogue - (arena->epilogue->prev_footer & MAX_BLK_SIZE));
+    size_t size = block->header & MAX_BLK_SIZE;
+    char* end = (char*) arena_end(arena);
+
+    if(arena == &arenas[0]) { //sf_mem_grow cannot take pages back, so they stay in the heap
+        uintptr_t from = ((uintptr_t) block + 32 + keep + PAGE_SZ - 1) & ~((uintptr_t) PAGE_SZ - 1);
+        uintptr_t to = ((uintptr_t) block + size) & ~((uintptr_t) PAGE_SZ - 1);
+        if(from >= to || madvise((void*) from, to - from, SF_TRIM_ADVICE) != 0) {
+            return 0;
+        }
+        return to - from;
+    }
+
+    //the new end leaves room for a minimum block and the epilogue
+    size_t unit = trim_unit(arena);
+    char* from = (char*) (((uintptr_t) block + 48 + keep + unit - 1) & ~((uintptr_t) unit - 1));
+    if(from >= end || mmap(from, end - from, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+                           -1, 0) == MAP_FAILED) {
+        return 0;
+    }
+
+    remove_block(arena, block);
+    block->header = ((from - 16) - (char*) block) | (block->header & 0x4);
+    sf_block* epilogue = (sf_block*) (from - 16);
+    epilogue->prev_footer = block->header;
+    epilogue->header = 0x8;
+    arena->epilogue = epilogue;
+    insert_wilderness(arena, block);
+
+    arena->brk = from;
+    arena->heapSize -= end - from;
+    if(from < arena->fresh) { //the pages are mapped anew when the heap grows back
+        arena->fresh = from;
+    }
+    return end - from;
+}
+
+//Trim the top of the heap down to keep bytes and release the pages of every other free block, arena->lock held
+static size_t arena_trim(sf_arena* arena, size_t keep) {
+    size_t released = trim_top(arena, keep);
+    if(arena->listEmpty != 0) {
+        //only blocks spanning more than a page have any to give up
+        int first = arena->policy == SF_POLICY_TLSF ? tlsf_index(PAGE_SZ + 32) : getIdx(PAGE_SZ + 32);
+        for(int i = next_list(arena, first); i >= 0; i = next_list(arena, i + 1)) {
+            sf_block* sentinel = list_head(arena, i);
+            for(sf_block* block = sentinel->body.links.next; block != sentinel; block = block->body.links.next) {
+                if((void*) block + (block->header & MAX_BLK_SIZE) != arena->epilogue) { //the top keeps keep bytes
+                    released += release_block(arena, block);
+                }
+            }
+        }
+    }
+    arena->released += released;
+    return released;
+}
+
+//Trim the top of the heap if a free has left more than the trim threshold there, arena->lock held
+static void trim_after_free(sf_arena* arena) {
+    if(trimThreshold != 0 && (arena->epilogue->header & 0x4) == 0 &&
+       (arena->epilogue->prev_footer & MAX_BLK_SIZE) > trimThreshold) {
+        arena->released += trim_top(arena, trimThreshold / 2); //half, so the next frees do not trim again
+    }
+}
+
+//Slab page containing ptr, or NULL if ptr does not point into one
+static sf_slab* slab_of(sf_arena* arena, void* ptr) {
+    uint64_t* map = __atomic_load_n(&arena->slabMap, __ATOMIC_ACQUIRE);
+    if(map == NULL || (char*) ptr < arena->slabBase) {
         return NULL;
     }
 
-    //New Requested block size min
-    size_t newSize = pad(rsize);
+    size_t page = ((char*) ptr - arena->slabBase) / PAGE_SZ;
+    if(page >= SLAB_MAP_BITS || (__atomic_load_n(&map[page / 64], __ATOMIC_RELAXED) & (1ULL << (page % 64))) == 0) {
+        return NULL;
+    }
+    return (sf_slab*) (arena->slabBase + page * PAGE_SZ);
+}
 
-    //Get current block
-    sf_block* oldBlock = (sf_block*) (pp - 16); //Get to root address from payload
-    size_t oldSize = oldBlock->header & MAX_BLK_SIZE;
-    size_t oldPayloadSize = oldBlock->header >> 32;
+//Bit set = slot on the arena's remote queue, set without the lock, so it cannot share freeMap
+static uint64_t* slab_queued(sf_slab* slab) {
+    return (uint64_t*) ((char*) slab + PAGE_SZ - SLAB_TAIL);
+}
 
-    //if same size, just return the pointer back, else get new pointer
-    if(newSize == oldSize) return pp;
-    currPayload -= oldPayloadSize;
-    memUsed -= oldSize;
+static void slab_mark(sf_arena* arena, sf_slab* slab, int isSlab) {
+    size_t page = ((char*) slab - arena->slabBase) / PAGE_SZ;
+    if(isSlab) {
+        __atomic_fetch_or(&arena->slabMap[page / 64], 1ULL << (page % 64), __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_and(&arena->slabMap[page / 64], ~(1ULL << (page % 64)), __ATOMIC_RELAXED);
+    }
+}
 
-    //new block is larger
-    if(oldSize < newSize) {
-        void* payload = sf_malloc(rsize);
-        if(payload == NULL) {
+//Carve a page for a slab or compact page out of the arena, not yet marked, arena->lock held
+static void* slab_page(sf_arena* arena) {
+    if(arena->slabMap == NULL) {
+        void* map = mmap(NULL, SLAB_MAP_BITS / 8 + 8, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(map == MAP_FAILED) {
             return NULL;
         }
+        //arena 0 starts wherever sf_mem_grow put it, the others at a page boundary
+        arena->slabBase = (char*) ((uintptr_t) (arena == &arenas[0] ? sf_mem_start() : arenaBase +
+                          (arena - arenas - 1) * SF_ARENA_RESERVE) & ~(PAGE_SZ - 1));
+        __atomic_store_n(&arena->slabMap, map, __ATOMIC_RELEASE);
+    }
 
-        payload = memcpy(payload, pp, rsize);
-        sf_free(pp);
-        return payload;
+    sf_block* block = heap_memalign(arena, PAGE_SZ, PAGE_SZ + 16, PAGE_SZ);
+    if(block == NULL) {
+        return NULL;
     }
+    arena->currPayload -= PAGE_SZ; //the page is counted in memUsed, only its objects count as payload
+    return block->body.payload;
+}
 
-    //new block is smaller
-    sf_block* newBlock = (sf_block*) split(oldBlock, newSize, rsize);
+//Carve a new slab page for objects of objSize out of the arena, arena->lock held
+static sf_slab* slab_create(sf_arena* arena, size_t objSize) {
+    sf_slab* slab = slab_page(arena);
+    if(slab == NULL) {
+        return NULL;
+    }
+    slab->objSize = objSize;
+    slab->count = (PAGE_SZ - SLAB_HDR - SLAB_TAIL) / objSize;
+    slab->freeCount = slab->count;
+    for(int i = 0; i < 4; i++) {
+        int bits = slab->count - i * 64;
+        slab->freeMap[i] = bits >= 64 ? ~0ULL : bits <= 0 ? 0 : (1ULL << bits) - 1;
+        slab_queued(slab)[i] = 0;
+    }
 
-    currPayload += newBlock->header >> 32;
-    memUsed += newBlock->header & MAX_BLK_SIZE;
-    return newBlock->body.payload;
+    int cls = objSize / 16 - 1;
+    slab->prev = NULL;
+    slab->next = arena->slabs[cls];
+    if(slab->next != NULL) {
+        slab->next->prev = slab;
+    }
+    arena->slabs[cls] = slab;
+    slab_mark(arena, slab, 1);
+    return slab;
 }
 
-double sf_fragmentation() {
-    if(memUsed == 0) return 0.0;
-    return (double) currPayload / (double) memUsed;
+static void slab_unlink(sf_arena* arena, sf_slab* slab) {
+    int cls = slab->objSize / 16 - 1;
+    if(slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        arena->slabs[cls] = slab->next;
+    }
+    if(slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
 }
 
-double sf_utilization() {
-    if(heapSize == 0) return 0.0;
-    return (double) maxPayload / (double) heapSize;
-}
\ No newline at end of file
+//Hand out one object of the slab class fitting size, arena->lock held
+static void* slab_malloc(sf_arena* arena, size_t size) {
+    int cls = (size - 1) / 16;
+    sf_slab* slab = arena->slabs[cls];
+    if(slab == NULL) {
+        slab = slab_create(arena, (size_t) (cls + 1) * 16);
+        if(slab == NULL) {
+            return NULL;
+        }
+    }
+
+    int word = 0;
+    while(slab->freeMap[word] == 0) {
+        word++;
+    }
+    int bit = __builtin_ctzll(slab->freeMap[word]);
+    slab->freeMap[word] &= ~(1ULL << bit);
+    if(--slab->freeCount == 0) { //full slabs leave the partial list until something is freed
+        slab_unlink(arena, slab);
+    }
+
+    arena->currPayload += slab->objSize; //objects have no header to remember the requested size
+    if(arena->currPayload > arena->maxPayload) {
+        arena->maxPayload = arena->currPayload;
+    }
+    return (void*) slab + SLAB_HDR + (word * 64 + bit) * slab->objSize;
+}
+
+//Slot of a handed out object in a slab page, -1 if ptr is not the start of one
+static int slab_slot(sf_slab* slab, void* ptr) {
+    size_t offset = (char*) ptr - (char*) slab;
+    size_t slot = (offset - SLAB_HDR) / slab->objSize;
+    if(offset < SLAB_HDR || (offset - SLAB_HDR) % slab->objSize != 0 || slot >= (size_t) slab->count ||
+       (slab->freeMap[slot / 64] & (1ULL << (slot % 64))) != 0) {
+        return -1;
+    }
+    return slot;
+}
+
+static void compact_link(sf_arena* arena, sf_cpage* page) {
+    page->prev = NULL;
+    page->next = arena->compact;
+    if(page->next != NULL) {
+        page->next->prev = page;
+    }
+    arena->compact = page;
+}
+
+static void compact_unlink(sf_arena* arena, sf_cpage* page) {
+    if(page->prev != NULL) {
+        page->prev->next = page->next;
+    } else {
+        arena->compact = page->next;
+    }
+    if(page->next != NULL) {
+        page->next->prev = page->prev;
+    }
+}
+
+//Make the block at offset a free block of size at the head of the page's free list; its previous block is allocated
+static void compact_push(sf_cpage* page, uint32_t offset, uint32_t size) {
+    CPAGE_WORD(page, offset) = size | 0x4;
+    CPAGE_WORD(page, offset + size - 4) = size;
+    CPAGE_WORD(page, offset + 4) = page->freeList;
+    CPAGE_WORD(page, offset + 8) = 0;
+    if(page->freeList != 0) {
+        CPAGE_WORD(page, page->freeList + 8) = offset;
+    }
+    page->freeList = offset;
+}
+
+static void compact_pull(sf_cpage* page, uint32_t offset) {
+    uint32_t next = CPAGE_WORD(page, offset + 4), prev = CPAGE_WORD(page, offset + 8);
+    if(prev != 0) {
+        CPAGE_WORD(page, prev + 4) = next;
+    } else {
+        page->freeList = next;
+    }
+    if(next != 0) {
+        CPAGE_WORD(page, next + 8) = prev;
+    }
+}
+
+//Carve a new compact page, one free block between its header and epilogue, out of the arena, arena->lock held
+static sf_cpage* compact_create(sf_arena* arena) {
+    sf_cpage* page = slab_page(arena);
+    if(page == NULL) {
+        return NULL;
+    }
+    page->objSize = 0;
+    page->freeList = 0;
+    page->freeBytes = CPAGE_END - CPAGE_FIRST;
+    compact_push(page, CPAGE_FIRST, CPAGE_END - CPAGE_FIRST);
+    CPAGE_WORD(page, CPAGE_END) = 0x8;
+
+    compact_link(arena, page);
+    slab_mark(arena, (sf_slab*) page, 1);
+    return page;
+}
+
+//Offset of the header of the allocated block whose payload is ptr, 0 if there is none
+static uint32_t compact_block(sf_cpage* page, void* ptr) {
+    size_t offset = (char*) ptr - 4 - (char*) page;
+    if(offset < CPAGE_FIRST || offset >= CPAGE_END || (offset - CPAGE_FIRST) % 16 != 0) {
+        return 0;
+    }
+    uint32_t header = CPAGE_WORD(page, offset);
+    uint32_t size = header & 0xFFF0;
+    if((header & 0x9) != 0x8 || size < 16 || offset + size > CPAGE_END) {
+        return 0;
+    }
+    return offset;
+}
+
+//Hand out the first block that fits size from the arena's compact pages, arena->lock held
+static void* compact_malloc(sf_arena* arena, size_t size) {
+    uint32_t need = size + 4 <= 16 ? 16 : (size + 4 + 15) & ~15;
+    uint32_t offset = 0;
+    sf_cpage* page;
+    for(page = arena->compact; page != NULL; page = page->next) {
+        if(page->freeBytes < need) {
+            continue;
+        }
+        offset = page->freeList;
+        while(offset != 0 && (CPAGE_WORD(page, offset) & 0xFFF0) < need) {
+            offset = CPAGE_WORD(page, offset + 4);
+        }
+        if(offset != 0) {
+            break;
+        }
+    }
+    if(page == NULL) {
+        page = compact_create(arena);
+        if(page == NULL) {
+            return NULL;
+        }
+        offset = page->freeList;
+    }
+
+    uint32_t blockSize = CPAGE_WORD(page, offset) & 0xFFF0;
+    compact_pull(page, offset);
+    if(blockSize - need >= 16) { //the rest stays free, after a block that is now allocated
+        compact_push(page, offset + need, blockSize - need);
+        blockSize = need;
+    } else { //the next block may be queued, see remote_put
+        __atomic_fetch_or(&CPAGE_WORD(page, offset + blockSize), 0x4, __ATOMIC_RELAXED);
+    }
+    CPAGE_WORD(page, offset) = (uint32_t) size << 16 | blockSize | 0x8 | 0x4;
+    page->freeBytes -= blockSize;
+    if(page->freeList == 0) { //full pages leave the list until something is freed
+        compact_unlink(arena, page);
+    }
+
+    arena->currPayload += size;
+    if(arena->currPayload > arena->maxPayload) {
+        arena->maxPayload = arena->currPayload;
+    }
+    return (char*) page + offset + 4;
+}
+
+//Return a block to its compact page, coalescing it with free neighbours, arena->lock held
+static void compact_free(sf_arena* arena, sf_cpage* page, void* ptr) {
+    uint32_t offset = compact_block(page, ptr);
+    if(offset == 0) {
+        abort();
+    }
+
+    uint32_t header = CPAGE_WORD(page, offset);
+    uint32_t size = header & 0xFFF0;
+    arena->currPayload -= header >> 16;
+    if(page->freeList == 0) {
+        compact_link(arena, page);
+    }
+    page->freeBytes += size;
+
+    uint32_t next = offset + size;
+    if((CPAGE_WORD(page, next) & 0x8) == 0) {
+        compact_pull(page, next);
+        size += CPAGE_WORD(page, next) & 0xFFF0;
+    }
+    if((header & 0x4) == 0) { //the header goes, or a second free would still find an allocated block
+        CPAGE_WORD(page, offset) = 0;
+        uint32_t prevSize = CPAGE_WORD(page, offset - 4);
+        offset -= prevSize;
+        compact_pull(page, offset);
+        size += prevSize;
+    }
+    compact_push(page, offset, size);
+    __atomic_fetch_and(&CPAGE_WORD(page, offset + size), ~(uint32_t) 0x4, __ATOMIC_RELAXED);
+
+    //give an empty page back to the heap unless it is the last one
+    if(page->freeBytes == CPAGE_END - CPAGE_FIRST && (page->prev != NULL || page->next != NULL)) {
+        compact_unlink(arena, page);
+        slab_mark(arena, (sf_slab*) page, 0);
+        arena->currPayload += PAGE_SZ;
+        heap_free(arena, (sf_block*) ((void*) page - 16));
+    }
+}
+
+//Return an object to its slab page, aborting on pointers that are not a handed out object, arena->lock held
+static void slab_free(sf_arena* arena, sf_slab* slab, void* ptr) {
+    if(slab->objSize == 0) {
+        compact_free(arena, (sf_cpage*) slab, ptr);
+        return;
+    }
+    int slot = slab_slot(slab, ptr);
+    if(slot < 0 || (__atomic_load_n(&slab_queued(slab)[slot / 64], __ATOMIC_RELAXED) & (1ULL << (slot % 64))) != 0) {
+        abort();
+    }
+
+    slab->freeMap[slot / 64] |= 1ULL << (slot % 64);
+    arena->currPayload -= slab->objSize;
+    int cls = slab->objSize / 16 - 1;
+    if(++slab->freeCount == 1) {
+        slab->prev = NULL;
+        slab->next = arena->slabs[cls];
+        if(slab->next != NULL) {
+            slab->next->prev = slab;
+        }
+        arena->slabs[cls] = slab;
+    }
+
+    //give an empty page back to the heap unless it is the last one of its class
+    if(slab->freeCount == slab->count && (slab->prev != NULL || slab->next != NULL)) {
+        slab_unlink(arena, slab);
+        slab_mark(arena, slab, 0);
+        arena->currPayload += PAGE_SZ;
+        heap_free(arena, (sf_block*) ((void*) slab - 16));
+    }
+}
+
+//Length of the mapping holding a huge block with payload bytes
+static size_t huge_len(size_t payload) {
+    return (offsetof(sf_huge, block.body) + payload + PAGE_SZ - 1) & ~((size_t) PAGE_SZ - 1);
+}
+
+//Huge block whose payload is ptr, or NULL if ptr cannot be one
+static sf_huge* huge_of(void* ptr) {
+    if(((uintptr_t) ptr & (PAGE_SZ - 1)) != offsetof(sf_huge, block.body)) {
+        return NULL;
+    }
+    sf_huge* huge = (sf_huge*) (ptr - offsetof(sf_huge, block.body));
+    return (huge->block.header & 0x2) != 0 ? huge : NULL;
+}
+
+static sf_arena* huge_arena(sf_huge* huge) {
+    return &arenas[((huge->block.header & MAX_BLK_SIZE) >> 4) % SF_MAX_ARENAS];
+}
+
+//Abort unless huge is an allocated block on its arena's list, arena->lock held
+static void huge_check(sf_huge* huge) {
+    if((huge->block.header & 0x8) == 0 || huge->next == NULL || huge->prev == NULL ||
+       huge->next->prev != huge || huge->prev->next != huge) {
+        sf_errno = EINVAL;
+        abort();
+    }
+}
+
+//Put a huge block on its arena's list and count it, arena->lock held
+static void huge_link(sf_arena* arena, sf_huge* huge) {
+    if(arena->huge.next == NULL) {
+        arena->huge.next = &arena->huge;
+        arena->huge.prev = &arena->huge;
+    }
+    huge->next = arena->huge.next;
+    huge->prev = &arena->huge;
+    arena->huge.next->prev = huge;
+    arena->huge.next = huge;
+
+    arena->hugePayload += huge->block.header >> 32;
+    arena->hugeMapped += huge->block.prev_footer;
+}
+
+//Take a huge block off its arena's list and stop counting it, arena->lock held
+static void huge_unlink(sf_arena* arena, sf_huge* huge) {
+    huge->prev->next = huge->next;
+    huge->next->prev = huge->prev;
+    huge->next = NULL;
+    huge->prev = NULL;
+
+    arena->hugePayload -= huge->block.header >> 32;
+    arena->hugeMapped -= huge->block.prev_footer;
+}
+
+//Map a block of its own for a request of size bytes, counted in arena
+static void* huge_malloc(sf_arena* arena, size_t size) {
+    size_t len = huge_len(size);
+    void* map = size > HUGE_MAX_PAYLOAD ? MAP_FAILED :
+                mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(map == MAP_FAILED) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    sf_huge* huge = (sf_huge*) map;
+    huge->block.prev_footer = len;
+    huge->block.header = (size << 32) | ((size_t) (arena - arenas) << 4) | 0x8 | 0x2;
+    pthread_mutex_lock(&arena->lock);
+    huge_link(arena, huge);
+    pthread_mutex_unlock(&arena->lock);
+    return huge->block.body.payload;
+}
+
+static void huge_free(sf_huge* huge) {
+    sf_arena* arena = huge_arena(huge);
+    pthread_mutex_lock(&arena->lock);
+    huge_check(huge);
+    huge_unlink(arena, huge);
+    pthread_mutex_unlock(&arena->lock);
+    munmap(huge, huge->block.prev_footer);
+}
+
+static void* malloc_untraced(size_t size);
+
+//Resize a huge block with mremap, moving it to the heap when it drops below the threshold
+static void* huge_realloc(sf_huge* huge, size_t rsize) {
+    sf_arena* arena = huge_arena(huge);
+    pthread_mutex_lock(&arena->lock);
+    huge_check(huge);
+    pthread_mutex_unlock(&arena->lock);
+
+    if(rsize == 0) {
+        huge_free(huge);
+        return NULL;
+    }
+
+    if(hugeThreshold == 0 || rsize < hugeThreshold || rsize > HUGE_MAX_PAYLOAD) {
+        void* payload = malloc_untraced(rsize);
+        if(payload == NULL) {
+            return NULL;
+        }
+        size_t usable = huge->block.prev_footer - offsetof(sf_huge, block.body);
+        memcpy(payload, huge->block.body.payload, usable < rsize ? usable : rsize);
+        huge_free(huge);
+        return payload;
+    }
+
+    size_t oldLen = huge->block.prev_footer;
+    size_t len = huge_len(rsize);
+    pthread_mutex_lock(&arena->lock);
+    huge_unlink(arena, huge);
+    pthread_mutex_unlock(&arena->lock);
+
+    sf_huge* moved = len == oldLen ? huge : mremap(huge, oldLen, len, MREMAP_MAYMOVE);
+    int failed = moved == MAP_FAILED;
+    if(failed) { //the old mapping is still there as it was
+        moved = huge;
+    } else {
+        moved->block.prev_footer = len;
+        moved->block.header = (rsize << 32) | (moved->block.header & 0xFFFFFFFF);
+    }
+    pthread_mutex_lock(&arena->lock);
+    huge_link(arena, moved);
+    pthread_mutex_unlock(&arena->lock);
+
+    if(failed) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+    return moved->block.body.payload;
+}
+
+/*
+ * Remote frees.  A thread freeing a block of an arena it does not allocate from pushes it onto
+ * that arena's remoteFrees with a compare and swap, without taking the lock or touching the free
+ * lists.  The blocks stay marked allocated, so neighbours never coalesce into them, and are
+ * chained through body.links.next.  A queued block has the unused low bit of its header set, as
+ * does a block of a compact page, and a queued slab object its bit in the map at the end of its
+ * page, all set with an atomic or
+ * whose old value catches a second sf_free of the same pointer; the locked checks refuse either.
+ * Nothing else in the payload marks a queued block, since the program may have left anything
+ * there.  The arena's own threads take the whole queue at once, the single consumer, and free it
+ * under the lock they took to allocate; sf_trim and sf_stats empty every queue too.
+ */
+
+//1 if a block of arena freed by the calling thread goes to the arena's remote queue
+static int is_remote(sf_arena* arena) {
+    if(!remoteFree || arenaBase == NULL) {
+        return 0;
+    }
+    //a thread that has not allocated yet has no arena, and every arena is someone else's
+    return arena != (arenaPolicy == SF_ARENA_BY_CPU ? thread_arena() : threadArena);
+}
+
+//Queue a block for its arena, return 0 if it does not look allocated and needs the locked checks
+static int remote_put(sf_arena* arena, void* pp) {
+    sf_block* block = (sf_block*) (pp - 16);
+    sf_slab* slab = slab_of(arena, pp);
+    if(slab != NULL && slab->objSize == 0) {
+        uint32_t* header = (uint32_t*) (pp - 4);
+        if(((uintptr_t) pp) % 16 != 0 || (*header & 0x9) != 0x8) {
+            return 0;
+        }
+        if((__atomic_fetch_or(header, 0x1, __ATOMIC_RELAXED) & 0x1) != 0) {
+            abort();
+        }
+    } else if(slab != NULL) { //a slab object has no header, slab_free checks the rest of its slot
+        size_t offset = (char*) pp - (char*) slab;
+        if(offset < SLAB_HDR || (offset - SLAB_HDR) % slab->objSize != 0) {
+            return 0;
+        }
+        size_t slot = (offset - SLAB_HDR) / slab->objSize;
+        if((__atomic_fetch_or(&slab_queued(slab)[slot / 64], 1ULL << (slot % 64), __ATOMIC_RELAXED) &
+            (1ULL << (slot % 64))) != 0) {
+            abort();
+        }
+    } else {
+        sf_header header = block->header;
+        size_t blockSize = header & MAX_BLK_SIZE;
+        if(blockSize < 32 || blockSize % 16 != 0 || ((uintptr_t) pp) % 16 != 0 || (header & 0x9) != 0x8 ||
+           block <= arena->prologue || (void*) block + blockSize > (void*) arena->epilogue) {
+            return 0;
+        }
+        if((__atomic_fetch_or(&block->header, 0x1, __ATOMIC_RELAXED) & 0x1) != 0) {
+            abort();
+        }
+    }
+
+    sf_block* head = __atomic_load_n(&arena->remoteFrees, __ATOMIC_RELAXED);
+    do {
+        block->body.links.next = head;
+    } while(!__atomic_compare_exchange_n(&arena->remoteFrees, &head, block, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return 1;
+}
+
+//Free every block on the arena's remote queue, arena->lock held
+static void remote_drain(sf_arena* arena) {
+    if(__atomic_load_n(&arena->remoteFrees, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+    sf_block* block = __atomic_exchange_n(&arena->remoteFrees, NULL, __ATOMIC_ACQUIRE);
+    while(block != NULL) {
+        sf_block* next = block->body.links.next;
+        void* pp = block->body.payload;
+        sf_slab* slab = slab_of(arena, pp);
+        if(slab != NULL && slab->objSize == 0) {
+            __atomic_fetch_and((uint32_t*) (pp - 4), ~(uint32_t) 0x1, __ATOMIC_RELAXED);
+            compact_free(arena, (sf_cpage*) slab, pp);
+        } else if(slab != NULL) {
+            size_t slot = ((char*) pp - (char*) slab - SLAB_HDR) / slab->objSize;
+            __atomic_fetch_and(&slab_queued(slab)[slot / 64], ~(1ULL << (slot % 64)), __ATOMIC_RELAXED);
+            slab_free(arena, slab, pp);
+        } else {
+            __atomic_fetch_and(&block->header, ~(sf_header) 0x1, __ATOMIC_RELAXED);
+            if(isInvalidPointer(arena, pp)) {
+                abort();
+            }
+            heap_free(arena, block);
+        }
+        block = next;
+    }
+}
+
+//Fold the payload this thread handed out or took back without a lock into the arena, arena->lock held
+static void tcache_merge_stats(tcache* tc, sf_arena* arena) {
+    int idx = arena - arenas;
+    arena->currPayload += tc->payloadDelta[idx];
+    tc->payloadDelta[idx] = 0;
+    //below 0 for a while when a block handed out by one thread is freed by another that folds first
+    if((long) arena->currPayload > (long) arena->maxPayload) {
+        arena->maxPayload = arena->currPayload;
+    }
+}
+
+//Give up to count blocks of one bin back to the free lists of the arenas they came from
+static void tcache_spill(tcache* tc, int bin, int count) {
+    sf_arena* locked = NULL;
+    while(count-- > 0 && tc->bins[bin] != NULL) {
+        sf_block* block = tc->bins[bin];
+        sf_arena* owner = arena_of(block);
+        if(owner != locked) { //blocks of one bin nearly always share an arena
+            if(locked != NULL) {
+                tcache_merge_stats(tc, locked);
+                pthread_mutex_unlock(&locked->lock);
+            }
+            pthread_mutex_lock(&owner->lock);
+            locked = owner;
+        }
+
+        tc->bins[bin] = block->body.links.next;
+        tc->bytes -= block->header & MAX_BLK_SIZE;
+        heap_free(owner, block);
+    }
+
+    if(locked != NULL) {
+        tcache_merge_stats(tc, locked);
+        pthread_mutex_unlock(&locked->lock);
+    }
+}
+
+//Empty every bin of a thread cache
+static void tcache_flush(tcache* tc) {
+    for(int i = 0; i < TCACHE_BINS; i++) {
+        tcache_spill(tc, i, INT_MAX);
+    }
+}
+
+static void tcache_exit(void* arg) {
+    tcache* tc = (tcache*) arg;
+    tcache_flush(tc);
+    for(int i = 0; i < SF_MAX_ARENAS; i++) { //per-CPU cache traffic that never took a lock
+        if(tc->payloadDelta[i] != 0) {
+            pthread_mutex_lock(&arenas[i].lock);
+            tcache_merge_stats(tc, &arenas[i]);
+            pthread_mutex_unlock(&arenas[i].lock);
+        }
+    }
+    tc->state = 2; //anything freed from now on goes straight to the free lists
+}
+
+static void tcache_make_key() {
+    pthread_key_create(&tcacheExitKey, tcache_exit);
+}
+
+/*
+ * Set the payload in the header of a cached block without the arena lock.  Whoever holds the lock
+ * may be setting or clearing the prv alloc bit of the same header as the block before it is
+ * allocated or freed, so both sides update it atomically, or one would lose the other's bits.
+ */
+static sf_header set_payload(sf_block* block, size_t payload) {
+    sf_header header = __atomic_load_n(&block->header, __ATOMIC_RELAXED), update;
+    do {
+        update = (payload << 32) | (header & 0xFFFFFFFF);
+    } while(!__atomic_compare_exchange_n(&block->header, &header, update, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return update;
+}
+
+//Push a block with its payload already cleared onto the bin for its size
+static void tcache_push(tcache* tc, sf_block* block) {
+    size_t blockSize = block->header & MAX_BLK_SIZE;
+    int bin = TCACHE_BIN(blockSize);
+    block->body.links.next = tc->bins[bin];
+    block->body.links.prev = &tcacheKey;
+    tc->bins[bin] = block;
+    tc->bytes += blockSize;
+}
+
+//Carve a batch of blocks of padded size sizeP out of an arena into the cache, arena->lock held
+static void tcache_refill(tcache* tc, sf_arena* arena, size_t sizeP) {
+    for(int i = 0; i < TCACHE_BATCH && tc->bytes + sizeP <= tcacheLimit; i++) {
+        sf_block* block = heap_malloc(arena, sizeP, 0);
+        if(block == NULL) {
+            return;
+        }
+
+        //split refuses to leave splinters, so the block can be 16 bytes larger than asked for
+        if((block->header & MAX_BLK_SIZE) > TCACHE_MAX_BLK) {
+            heap_free(arena, block);
+            return;
+        }
+        tcache_push(tc, block);
+    }
+}
+
+//Serve an allocation from the calling thread's cache, refilling the bin in one batch when empty
+static sf_block* tcache_get(size_t sizeP, size_t size) {
+    tcache* tc = &threadCache;
+    if(tc->state == 2) {
+        return NULL;
+    }
+
+    int bin = TCACHE_BIN(sizeP);
+    if(tc->bins[bin] == NULL) {
+        if(tc->state == 0) {
+            //outside the lock, and marked first: pthread_setspecific may come back here through malloc
+            tc->state = 1;
+            pthread_once(&tcacheOnce, tcache_make_key);
+            pthread_setspecific(tcacheExitKey, tc);
+        }
+        sf_arena* arena = thread_arena();
+        pthread_mutex_lock(&arena->lock);
+        remote_drain(arena);
+        tcache_refill(tc, arena, sizeP);
+        tcache_merge_stats(tc, arena);
+        pthread_mutex_unlock(&arena->lock);
+        if(tc->bins[bin] == NULL) {
+            return NULL;
+        }
+    }
+
+    sf_block* block = tc->bins[bin];
+    tc->bins[bin] = block->body.links.next;
+    size_t blockSize = block->header & MAX_BLK_SIZE;
+    tc->bytes -= blockSize;
+    tc->payloadDelta[arena_of(block) - arenas] += size;
+
+    alloc_footer(block, set_payload(block, size));
+    return block;
+}
+
+//1 if block is sitting in the thread's cache, which leaves it marked allocated.  This walks the
+//block's bin, up to tcacheLimit / 32 blocks for the smallest size, on every free the key matches
+static int tcache_holds(tcache* tc, sf_block* block) {
+    size_t blockSize = block->header & MAX_BLK_SIZE;
+    if(block->body.links.prev != &tcacheKey || blockSize > TCACHE_MAX_BLK) {
+        return 0;
+    }
+    for(sf_block* cached = tc->bins[TCACHE_BIN(blockSize)]; cached != NULL; cached = cached->body.links.next) {
+        if(cached == block) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//Absorb a freed block into the calling thread's cache, return 0 if it has to go to the free lists
+static int tcache_put(sf_arena* arena, void* pp) {
+    tcache* tc = &threadCache;
+    sf_block* block = (sf_block*) (pp - 16);
+    sf_header header = block->header;
+    size_t blockSize = header & MAX_BLK_SIZE;
+    if(tc->state == 2 || blockSize > TCACHE_MAX_BLK) {
+        return 0;
+    }
+
+    //cheap header checks only, the full neighbour checks need the arena lock
+    if(blockSize < 32 || blockSize % 16 != 0 || ((uintptr_t) pp) % 16 != 0 || (header & 0x9) != 0x8 ||
+       block <= arena->prologue || (void*) block + blockSize > (void*) arena->epilogue) {
+        return 0;
+    }
+
+    if(tcache_holds(tc, block)) {
+        abort();
+    }
+
+    if(tc->bytes + blockSize > tcacheLimit) {
+        int bin = TCACHE_BIN(blockSize);
+        int count = 0;
+        for(sf_block* cached = tc->bins[bin]; cached != NULL; cached = cached->body.links.next) {
+            count++;
+        }
+        tcache_spill(tc, bin, (count + 1) / 2);
+        if(tc->bytes + blockSize > tcacheLimit) { //other bins hold the bytes, start over
+            tcache_flush(tc);
+        }
+
+        if(blockSize > tcacheLimit) {
+            return 0;
+        }
+    }
+
+    tc->payloadDelta[arena - arenas] -= header >> 32;
+    alloc_footer(block, set_payload(block, 0)); //a spill may have freed the previous block and cleared our prv alloc bit
+    tcache_push(tc, block);
+    return 1;
+}
+
+/*
+ * Per-CPU caches.  With a per-CPU limit set and restartable sequences (rseq) registered for the
+ * thread by the C library, small blocks are cached per CPU in place of per thread, so that the
+ * memory caches hold is bounded by the number of CPUs however many threads there are.  Each bin
+ * of a CPU's cache is an array stack whose count is only ever written by the last store of a
+ * restartable sequence.  The kernel moves a thread that is preempted, migrated or signalled
+ * inside one to its abort handler, which starts it over, so a sequence runs as if it were alone
+ * on its CPU, without a lock or an atomic instruction.  Cached blocks are kept the way a thread
+ * cache keeps them, still marked allocated and with body.links.prev set to &cpuCacheKey, and
+ * their payload is accounted in the calling thread's tcache payloadDelta.  Bin i holds at most
+ * cpuBinCap[i] blocks, which share the limit evenly between the bins.  Without rseq the thread
+ * caches stand in, with the same limit.
+ *
+ * Another thread empties a CPU's cache by setting its cpuStop flag, which every sequence checks
+ * before it touches a bin, and fencing the CPU with membarrier, which aborts a sequence running
+ * there; one that starts over sees the flag and leaves the bins alone, so until the flag is
+ * cleared they are the drainer's.  Where the kernel has no rseq fence (before Linux 5.10) the
+ * drainer moves itself onto each CPU in turn instead, and cannot reach those it may not run on.
+ */
+static size_t cpuCacheLimit = SF_CPU_CACHE_BYTES;
+static long cpuBinCap[TCACHE_BINS]; //read inside the sequences, so a new cap holds from the next one
+static pthread_once_t cpuCacheOnce = PTHREAD_ONCE_INIT;
+
+static void cpu_cache_caps(size_t bytes) {
+    for(int i = 0; i < TCACHE_BINS; i++) {
+        size_t cap = bytes / TCACHE_BINS / (32 + 16 * i);
+        __atomic_store_n(&cpuBinCap[i], cap > CPU_CACHE_SLOTS ? CPU_CACHE_SLOTS : (long) cap, __ATOMIC_RELAXED);
+    }
+}
+
+#if CPU_CACHE_RSEQ
+typedef struct cpu_bin {
+    long count; //blocks in slot
+    sf_block* slot[CPU_CACHE_SLOTS];
+} cpu_bin;
+
+static cpu_bin (*cpuCaches)[TCACHE_BINS] = NULL; //TCACHE_BINS bins per CPU, NULL without rseq
+static int cpuCount = 0;
+static long* cpuStop = NULL; //per CPU, 1 while another thread empties its bins
+static int cpuFence = 0; //1 if membarrier can abort the sequences running on a CPU
+static sf_block cpuCacheKey;
+static pthread_mutex_t cpuCacheLock = PTHREAD_MUTEX_INITIALIZER; //serializes sf_cpu_cache_limit
+
+#define RSEQ_STR_(x) #x
+#define RSEQ_STR(x) RSEQ_STR_(x)
+
+//Start a restartable sequence running from 1: to the commit at 2:, leaving it at 4: if the thread is not on cpu
+#define RSEQ_BEGIN \
+    ".pushsection __rseq_cs, \"aw\"\n\t" \
+    ".balign 32\n\t" \
+    "3:\n\t" \
+    ".long 0, 0\n\t" \
+    ".quad 1f, (2f - 1f), 4f\n\t" \
+    ".popsection\n\t" \
+    "leaq 3b(%%rip), %%rax\n\t" \
+    "movq %%rax, %[rseqCs]\n\t" \
+    "1:\n\t" \
+    "cmpl %[cpu], %[cpuId]\n\t" \
+    "jnz 4f\n\t"
+
+//End it, with the abort handler 4: after the signature the kernel checks, jumping to label
+#define RSEQ_END(label) \
+    "2:\n\t" \
+    ".pushsection __rseq_failure, \"ax\"\n\t" \
+    ".byte 0x0f, 0xb9, 0x3d\n\t" \
+    ".long " RSEQ_STR(RSEQ_SIG) "\n\t" \
+    "4:\n\t" \
+    "jmp %l[" #label "]\n\t" \
+    ".popsection\n\t"
+
+static inline struct rseq* rseq_self() {
+    return (struct rseq*) ((char*) __builtin_thread_pointer() + __rseq_offset);
+}
+
+static void cpu_cache_init() {
+    int count = sysconf(_SC_NPROCESSORS_CONF);
+    if(__rseq_size != 0 && (int) rseq_self()->cpu_id >= 0 && count > 0) {
+        void* map = mmap(NULL, count * (sizeof(*cpuCaches) + sizeof(long)), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(map != MAP_FAILED) {
+            cpuCount = count;
+            cpuCaches = map;
+            cpuStop = (long*) (cpuCaches + count);
+            cpuFence = syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ, 0, 0) == 0;
+            cpu_cache_caps(cpuCacheLimit);
+            return;
+        }
+    }
+    if(tcacheLimit == 0) {
+        tcacheLimit = cpuCacheLimit;
+    }
+    cpuCacheLimit = 0;
+}
+
+//Push a block onto a bin of the calling thread's CPU, 0 if the bin is full
+static int cpu_push(int bin, sf_block* block) {
+    struct rseq* rs = rseq_self();
+    for(;;) {
+        int cpu = __atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+        if(cpu < 0 || cpu >= cpuCount) {
+            return 0;
+        }
+        cpu_bin* b = &cpuCaches[cpu][bin];
+        __asm__ goto(RSEQ_BEGIN
+                     "cmpq $0, %[stop]\n\t"
+                     "jnz %l[full]\n\t"
+                     "movq %c[count](%[b]), %%rcx\n\t"
+                     "cmpq %[cap], %%rcx\n\t"
+                     "jae %l[full]\n\t"
+                     "movq %[block], %c[slot](%[b], %%rcx, 8)\n\t"
+                     "incq %%rcx\n\t"
+                     "movq %%rcx, %c[count](%[b])\n\t" //commit
+                     RSEQ_END(restart)
+                     : [rseqCs] "+m" (rs->rseq_cs), [cache] "+m" (*b)
+                     : [cpu] "r" (cpu), [cpuId] "m" (rs->cpu_id), [stop] "m" (cpuStop[cpu]),
+                       [cap] "m" (cpuBinCap[bin]), [b] "r" (b), [block] "r" (block),
+                       [count] "i" (offsetof(cpu_bin, count)), [slot] "i" (offsetof(cpu_bin, slot))
+                     : "memory", "cc", "rax", "rcx"
+                     : restart, full);
+        return 1;
+    restart:;
+    }
+full:
+    return 0;
+}
+
+//Pop the block last pushed onto a bin of the calling thread's CPU, NULL if there is none
+static sf_block* cpu_pop(int bin) {
+    struct rseq* rs = rseq_self();
+    sf_block* block;
+    for(;;) {
+        int cpu = __atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+        if(cpu < 0 || cpu >= cpuCount) {
+            return NULL;
+        }
+        cpu_bin* b = &cpuCaches[cpu][bin];
+        __asm__ goto(RSEQ_BEGIN
+                     "cmpq $0, %[stop]\n\t"
+                     "jnz %l[empty]\n\t"
+                     "movq %c[count](%[b]), %%rcx\n\t"
+                     "testq %%rcx, %%rcx\n\t"
+                     "jz %l[empty]\n\t"
+                     "decq %%rcx\n\t"
+                     "movq %c[slot](%[b], %%rcx, 8), %%rax\n\t"
+                     "movq %%rax, %[block]\n\t"
+                     "movq %%rcx, %c[count](%[b])\n\t" //commit
+                     RSEQ_END(restart)
+                     : [rseqCs] "+m" (rs->rseq_cs), [cache] "+m" (*b), [block] "=m" (block)
+                     : [cpu] "r" (cpu), [cpuId] "m" (rs->cpu_id), [stop] "m" (cpuStop[cpu]), [b] "r" (b),
+                       [count] "i" (offsetof(cpu_bin, count)), [slot] "i" (offsetof(cpu_bin, slot))
+                     : "memory", "cc", "rax", "rcx"
+                     : restart, empty);
+        return block;
+    restart:;
+    }
+empty:
+    return NULL;
+}
+
+//1 if block sits in some CPU's cache
+static int cpu_cache_holds(sf_block* block) {
+    if(cpuCaches == NULL || block->body.links.prev != &cpuCacheKey) {
+        return 0;
+    }
+    int bin = TCACHE_BIN(block->header & MAX_BLK_SIZE);
+    for(int cpu = 0; cpu < cpuCount; cpu++) {
+        cpu_bin* b = &cpuCaches[cpu][bin];
+        long count = __atomic_load_n(&b->count, __ATOMIC_RELAXED);
+        for(long i = 0; i < count && i < CPU_CACHE_SLOTS; i++) {
+            if(b->slot[i] == block) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+//Give blocks taken out of the caches back to the free lists, each under its own arena's lock
+static void cpu_cache_free(sf_block** blocks, int n) {
+    tcache* tc = &threadCache;
+    sf_arena* locked = NULL;
+    for(int i = 0; i < n; i++) {
+        sf_arena* owner = arena_of(blocks[i]);
+        if(owner != locked) {
+            if(locked != NULL) {
+                tcache_merge_stats(tc, locked);
+                pthread_mutex_unlock(&locked->lock);
+            }
+            pthread_mutex_lock(&owner->lock);
+            locked = owner;
+        }
+        heap_free(owner, blocks[i]);
+    }
+    if(locked != NULL) {
+        tcache_merge_stats(tc, locked);
+        pthread_mutex_unlock(&locked->lock);
+    }
+}
+
+//Empty a CPU's cache from whatever CPU the calling thread is on, 0 if the CPU cannot be fenced
+static int cpu_cache_steal(int cpu) {
+    __atomic_store_n(&cpuStop[cpu], 1, __ATOMIC_SEQ_CST);
+    if(syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, MEMBARRIER_CMD_FLAG_CPU, cpu) != 0) {
+        __atomic_store_n(&cpuStop[cpu], 0, __ATOMIC_RELEASE);
+        return 0;
+    }
+    for(int bin = 0; bin < TCACHE_BINS; bin++) {
+        cpu_bin* b = &cpuCaches[cpu][bin];
+        sf_block* blocks[CPU_CACHE_SLOTS];
+        int n = b->count;
+        memcpy(blocks, b->slot, n * sizeof(sf_block*));
+        b->count = 0;
+        cpu_cache_free(blocks, n);
+    }
+    __atomic_store_n(&cpuStop[cpu], 0, __ATOMIC_RELEASE);
+    return 1;
+}
+
+//Empty a CPU's cache by running on it, so that the pops are that CPU's own; 0 if the thread may not run there
+static int cpu_cache_visit(int cpu) {
+    cpu_set_t one;
+    CPU_ZERO(&one);
+    CPU_SET(cpu, &one);
+    if(cpu >= CPU_SETSIZE || sched_setaffinity(0, sizeof(one), &one) != 0) {
+        return 0;
+    }
+    for(int bin = 0; bin < TCACHE_BINS; bin++) {
+        sf_block* blocks[CPU_CACHE_SLOTS];
+        int n = 0;
+        while(n < CPU_CACHE_SLOTS && (blocks[n] = cpu_pop(bin)) != NULL) {
+            n++;
+        }
+        cpu_cache_free(blocks, n);
+    }
+    return 1;
+}
+
+//Empty every CPU's cache, return how many CPUs could not be reached and keep their blocks
+static int cpu_cache_drain() {
+    cpu_set_t saved;
+    int moved = 0, skipped = 0;
+    for(int cpu = 0; cpu < cpuCount; cpu++) {
+        if(cpuFence && cpu_cache_steal(cpu)) {
+            continue;
+        }
+        if(!moved) {
+            if(sched_getaffinity(0, sizeof(saved), &saved) != 0) {
+                return cpuCount - cpu;
+            }
+            moved = 1;
+        }
+        skipped += !cpu_cache_visit(cpu);
+    }
+    if(moved) {
+        sched_setaffinity(0, sizeof(saved), &saved);
+    }
+    return skipped;
+}
+
+//Serve an allocation from the calling thread's CPU, refilling the bin in one batch when empty
+static sf_block* cpu_cache_get(size_t sizeP, size_t size) {
+    pthread_once(&cpuCacheOnce, cpu_cache_init);
+    if(cpuCaches == NULL) {
+        return NULL;
+    }
+    tcache* tc = &threadCache;
+    if(tc->state == 0) { //for the payload still to fold in at thread exit
+        tc->state = 1;
+        pthread_once(&tcacheOnce, tcache_make_key);
+        pthread_setspecific(tcacheExitKey, tc);
+    }
+
+    int bin = TCACHE_BIN(sizeP);
+    sf_block* block = cpu_pop(bin);
+    if(block == NULL) {
+        sf_arena* arena = thread_arena();
+        pthread_mutex_lock(&arena->lock);
+        remote_drain(arena);
+        block = heap_malloc(arena, sizeP, 0);
+        for(int i = 1; block != NULL && i < TCACHE_BATCH; i++) {
+            sf_block* extra = heap_malloc(arena, sizeP, 0);
+            if(extra == NULL) {
+                break;
+            }
+            //split refuses to leave splinters, so the block can be 16 bytes larger than asked for
+            size_t extraSize = extra->header & MAX_BLK_SIZE;
+            extra->body.links.prev = &cpuCacheKey;
+            if(extraSize > TCACHE_MAX_BLK || !cpu_push(TCACHE_BIN(extraSize), extra)) {
+                heap_free(arena, extra);
+                break;
+            }
+        }
+        tcache_merge_stats(tc, arena);
+        pthread_mutex_unlock(&arena->lock);
+        if(block == NULL) {
+            return NULL;
+        }
+    }
+
+    tc->payloadDelta[arena_of(block) - arenas] += size;
+    alloc_footer(block, set_payload(block, size));
+    return block;
+}
+
+//Absorb a freed block into the cache of the calling thread's CPU, return 0 if it has to go to the free lists
+static int cpu_cache_put(sf_arena* arena, void* pp) {
+    sf_block* block = (sf_block*) (pp - 16);
+    sf_header header = block->header;
+    size_t blockSize = header & MAX_BLK_SIZE;
+    if(cpuCaches == NULL || blockSize > TCACHE_MAX_BLK) {
+        return 0;
+    }
+
+    //cheap header checks only, the full neighbour checks need the arena lock
+    if(blockSize < 32 || blockSize % 16 != 0 || ((uintptr_t) pp) % 16 != 0 || (header & 0x9) != 0x8 ||
+       block <= arena->prologue || (void*) block + blockSize > (void*) arena->epilogue) {
+        return 0;
+    }
+    if(cpu_cache_holds(block)) {
+        abort();
+    }
+
+    threadCache.payloadDelta[arena - arenas] -= header >> 32;
+    alloc_footer(block, set_payload(block, 0));
+    block->body.links.prev = &cpuCacheKey;
+    int bin = TCACHE_BIN(blockSize);
+    if(cpu_push(bin, block)) {
+        return 1;
+    }
+
+    //the bin is full: half of it goes back to the free lists, to make room for this block
+    sf_block* spill[CPU_CACHE_SLOTS / 2 + 1];
+    int n = 0;
+    long half = (__atomic_load_n(&cpuBinCap[bin], __ATOMIC_RELAXED) + 1) / 2;
+    while(n < half && n < CPU_CACHE_SLOTS / 2 && (spill[n] = cpu_pop(bin)) != NULL) {
+        n++;
+    }
+    if(!cpu_push(bin, block)) {
+        spill[n++] = block;
+    }
+    cpu_cache_free(spill, n);
+    return 1;
+}
+
+#else
+static void cpu_cache_init() {
+    if(tcacheLimit == 0) {
+        tcacheLimit = cpuCacheLimit;
+    }
+    cpuCacheLimit = 0;
+}
+
+static sf_block* cpu_cache_get(size_t sizeP, size_t size) {
+    pthread_once(&cpuCacheOnce, cpu_cache_init);
+    return NULL;
+}
+
+static int cpu_cache_put(sf_arena* arena, void* pp) {
+    return 0;
+}
+
+static int cpu_cache_holds(sf_block* block) {
+    return 0;
+}
+#endif
+
+/*
+ * The trace recorder.  While a trace is open, the public calls append one sf_trace_record per
+ * allocation or free to traceBuf, which is written out whenever it fills.  Records are stamped and
+ * stored under traceLock, a free's before the block is released and an allocation's after it is
+ * obtained, so the file order is an order in which the calls could have happened.  A realloc keeps
+ * traceLock for the whole call, since it does both at once.  Nothing is recorded while traceFd is
+ * -1, and the public calls only read it then.
+ */
+static int traceFd = -1;
+static pid_t tracePid; //process that opened the trace, a forked child stops recording
+static long traceStart; //CLOCK_MONOTONIC nanoseconds at sf_trace_start
+//recursive, a thread cache registering itself inside a realloc can come back through calloc; a
+//forked child gets a new one from sf_unlock_all
+static pthread_mutex_t traceLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static sf_trace_record traceBuf[TRACE_RECORDS];
+static int traceCount = 0;
+
+//Write all of buf to fd, as far as it goes: 0 on success, -1 if some of it is lost
+static int write_all(int fd, const void* buf, size_t left) {
+    while(left > 0) {
+        ssize_t n = write(fd, buf, left);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return -1;
+        }
+        buf += n;
+        left -= n;
+    }
+    return 0;
+}
+
+//Write out the buffered records, traceLock held; if that fails the rest of the trace is lost and
+//the program goes on
+static void trace_flush() {
+    write_all(traceFd, traceBuf, traceCount * sizeof(sf_trace_record));
+    traceCount = 0;
+}
+
+//Append a record, traceLock held
+static void trace_put(int op, void* id, uint64_t aux, size_t size) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    sf_trace_record* rec = &traceBuf[traceCount++];
+    rec->time = ts.tv_sec * 1000000000L + ts.tv_nsec - traceStart;
+    rec->id = (uintptr_t) id;
+    rec->aux = aux;
+    rec->size = size;
+    rec->op = op;
+    rec->zero = 0;
+    if(traceCount == TRACE_RECORDS) {
+        trace_flush();
+    }
+}
+
+static void trace(int op, void* id, uint64_t aux, size_t size) {
+    if(__atomic_load_n(&traceFd, __ATOMIC_RELAXED) < 0) {
+        return;
+    }
+    pthread_mutex_lock(&traceLock);
+    if(traceFd >= 0) {
+        trace_put(op, id, aux, size);
+    }
+    pthread_mutex_unlock(&traceLock);
+}
+
+/*
+ * The sampling heap profiler.  Each thread counts the bytes it allocates down in profCountdown,
+ * and the allocation that takes it below 0 is sampled: its call stack is kept in profTable under
+ * its payload address until it is freed, and the countdown starts over from an interval drawn
+ * from an exponential distribution with mean profRate, so that every allocated byte is as likely
+ * as any other to be the one sampled.  An allocation that is not sampled costs a subtraction and
+ * a test, and a free a look at the profTable list its address hashes to, which is empty but for
+ * the odd collision unless the block is sampled.  While profRate is 0 a thread only looks at it
+ * again every PROF_RECHECK bytes.  profTable is not mapped until profiling is first turned on, or
+ * until the first sample when SF_PROF_RATE turns it on from the start.
+ */
+typedef struct prof_sample {
+    struct prof_sample* next; //in its profTable list, or in profSpare
+    void* payload;
+    size_t size; //requested
+    size_t rate; //profRate when it was taken
+    int depth;
+    void* stack[PROF_DEPTH];
+} prof_sample;
+
+static size_t profRate = SF_PROF_RATE;
+static size_t profLastRate = SF_PROF_RATE; //the last profRate other than 0, for the dump
+static pthread_mutex_t profLock = PTHREAD_MUTEX_INITIALIZER; //guards the samples
+static prof_sample** profTable = NULL; //written under profLock, its list heads read without it
+static prof_sample* profSpare = NULL;
+static size_t profSamples = 0; //in profTable
+static __thread long profCountdown = 0; //bytes this thread allocates before its next sample
+static __thread size_t profArmed = 0; //profRate that profCountdown was drawn for
+static __thread uint64_t profSeed = 0;
+static __thread int inProfiler = 0; //the profiler's own allocations and frees are not looked at
+
+//Bytes to the next sample of this thread, exponentially distributed with mean rate
+static long prof_interval(size_t rate) {
+    if(profSeed == 0) {
+        profSeed = (uintptr_t) &profSeed ^ 0x9E3779B97F4A7C15ULL; //a different sequence per thread
+    }
+    profSeed ^= profSeed << 13;
+    profSeed ^= profSeed >> 7;
+    profSeed ^= profSeed << 17;
+    double u = ((profSeed >> 11) + 1.0) / 9007199254740992.0; //(0, 1]
+    return (long) (-log(u) * rate);
+}
+
+//Map profTable unless it is already, profLock held; -1 if it cannot be
+static int prof_map_table() {
+    if(profTable == NULL) {
+        void* table = mmap(NULL, PROF_BUCKETS * sizeof(prof_sample*), PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(table == MAP_FAILED) {
+            return -1;
+        }
+        __atomic_store_n(&profTable, table, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+//Draw profCountdown again for rate
+static void prof_arm(size_t rate) {
+    profArmed = rate;
+    profCountdown = rate == 0 ? PROF_RECHECK : prof_interval(rate);
+}
+
+//The allocation that took profCountdown below 0
+__attribute__((noinline)) static void prof_sample_alloc(void* payload, size_t size) {
+    size_t rate = __atomic_load_n(&profRate, __ATOMIC_ACQUIRE);
+    if(inProfiler) {
+        return;
+    }
+    if(rate != profArmed || rate == 0) { //turned on or off since this thread last looked
+        prof_arm(rate);
+        return;
+    }
+    prof_arm(rate);
+
+    inProfiler = 1; //backtrace can allocate
+    void* stack[PROF_DEPTH + 1];
+    int depth = backtrace(stack, PROF_DEPTH + 1) - 1; //without this function
+    pthread_mutex_lock(&profLock);
+    if(profSpare == NULL) {
+        prof_sample* chunk = mmap(NULL, PROF_CHUNK * sizeof(prof_sample), PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(chunk != MAP_FAILED) {
+            for(int i = 0; i < PROF_CHUNK; i++) {
+                chunk[i].next = profSpare;
+                profSpare = &chunk[i];
+            }
+        }
+    }
+    prof_sample* sample = profSpare;
+    if(sample != NULL && prof_map_table() == 0) { //else the sample is lost
+        profSpare = sample->next;
+        sample->payload = payload;
+        sample->size = size;
+        sample->rate = rate;
+        sample->depth = depth < 0 ? 0 : depth;
+        memcpy(sample->stack, stack + 1, sample->depth * sizeof(void*));
+        sample->next = profTable[PROF_BUCKET(payload)];
+        __atomic_store_n(&profTable[PROF_BUCKET(payload)], sample, __ATOMIC_RELAXED);
+        profSamples++;
+    }
+    pthread_mutex_unlock(&profLock);
+    inProfiler = 0;
+}
+
+static inline void prof_alloc(void* payload, size_t size) {
+    if((profCountdown -= (long) size) < 0) {
+        prof_sample_alloc(payload, size);
+    }
+}
+
+__attribute__((noinline)) static prof_sample* prof_detach_slow(void* payload) {
+    if(inProfiler) {
+        return NULL;
+    }
+    pthread_mutex_lock(&profLock);
+    prof_sample** link = &profTable[PROF_BUCKET(payload)];
+    while(*link != NULL && (*link)->payload != payload) {
+        link = &(*link)->next;
+    }
+    prof_sample* sample = *link;
+    if(sample != NULL) {
+        __atomic_store_n(link, sample->next, __ATOMIC_RELAXED);
+        profSamples--;
+    }
+    pthread_mutex_unlock(&profLock);
+    return sample;
+}
+
+/*
+ * Take the sample of payload out of profTable, NULL if it has none.  A list head read without
+ * profLock is good enough: the block is allocated, so its own sample went in before the caller
+ * got to know its address.
+ */
+static inline prof_sample* prof_detach(void* payload) {
+    prof_sample** table = __atomic_load_n(&profTable, __ATOMIC_ACQUIRE);
+    if(table == NULL || __atomic_load_n(&table[PROF_BUCKET(payload)], __ATOMIC_RELAXED) == NULL) {
+        return NULL;
+    }
+    return prof_detach_slow(payload);
+}
+
+static inline void prof_free(void* payload) {
+    prof_sample* sample = prof_detach(payload);
+    if(sample != NULL) {
+        pthread_mutex_lock(&profLock);
+        sample->next = profSpare;
+        profSpare = sample;
+        pthread_mutex_unlock(&profLock);
+    }
+}
+
+//After a realloc to payload, put the old block's sample back where the block is now, if it still is
+static void prof_realloc(prof_sample* sample, void* payload, size_t size) {
+    if(sample == NULL) {
+        if(payload != NULL) {
+            prof_alloc(payload, size);
+        }
+        return;
+    }
+    pthread_mutex_lock(&profLock);
+    if(payload == NULL && size == 0) { //freed
+        sample->next = profSpare;
+        profSpare = sample;
+    } else {
+        if(payload != NULL) { //else the realloc failed and the block did not move
+            sample->payload = payload;
+            sample->size = size;
+        }
+        sample->next = profTable[PROF_BUCKET(sample->payload)];
+        __atomic_store_n(&profTable[PROF_BUCKET(sample->payload)], sample, __ATOMIC_RELAXED);
+        profSamples++;
+    }
+    pthread_mutex_unlock(&profLock);
+}
+
+static void* malloc_untraced(size_t size) {
+    if(size == 0) { //Empty request
+        return NULL;
+    }
+
+    if(hugeThreshold != 0 && size >= hugeThreshold) {
+        return huge_malloc(thread_arena(), size);
+    }
+    if(size > MAX_BLK_SIZE - 16) { //pad would overflow, or the block would not fit its header
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    if(size <= compactMax || size <= slabMax) {
+        sf_arena* arena = thread_arena();
+        pthread_mutex_lock(&arena->lock);
+        remote_drain(arena);
+        void* object = size <= compactMax ? compact_malloc(arena, size) : slab_malloc(arena, size);
+        pthread_mutex_unlock(&arena->lock);
+        if(object != NULL) {
+            return object;
+        }
+    }
+
+    size_t sizeP = pad(size);
+    if(sizeP <= TCACHE_MAX_BLK && cpuCacheLimit != 0) {
+        sf_block* cached = cpu_cache_get(sizeP, size);
+        if(cached != NULL) {
+            return cached->body.payload;
+        }
+    }
+    if(sizeP <= TCACHE_MAX_BLK && tcacheLimit != 0) {
+        sf_block* cached = tcache_get(sizeP, size);
+        if(cached != NULL) {
+            return cached->body.payload;
+        }
+    }
+
+    sf_arena* arena = thread_arena();
+    pthread_mutex_lock(&arena->lock);
+    remote_drain(arena);
+    sf_block* allocated = heap_malloc(arena, sizeP, size);
+    pthread_mutex_unlock(&arena->lock);
+
+    if(allocated == NULL) {
+        return NULL;
+    }
+    return allocated->body.payload;
+}
+
+void *sf_malloc(size_t size) {
+    void* payload = malloc_untraced(size);
+    if(payload != NULL) {
+        trace(SF_TRACE_MALLOC, payload, 0, size);
+        prof_alloc(payload, size);
+    }
+    return payload;
+}
+
+static void free_untraced(void *pp) {
+    if(pp == NULL) {
+        abort();
+    }
+
+    sf_huge* huge = huge_of(pp);
+    if(huge != NULL) {
+        huge_free(huge);
+        return;
+    }
+
+    sf_arena* arena = arena_of(pp);
+    if(is_remote(arena) && remote_put(arena, pp)) {
+        return;
+    }
+    sf_slab* slab = slab_of(arena, pp);
+    if(slab != NULL) {
+        pthread_mutex_lock(&arena->lock);
+        slab_free(arena, slab, pp);
+        pthread_mutex_unlock(&arena->lock);
+        return;
+    }
+
+    if(cpuCacheLimit != 0 && cpu_cache_put(arena, pp)) {
+        return;
+    }
+    if(tcacheLimit != 0 && tcache_put(arena, pp)) {
+        return;
+    }
+
+    pthread_mutex_lock(&arena->lock);
+    if(isInvalidPointer(arena, pp)) {
+        abort();
+    }
+    heap_free(arena, (sf_block*) (pp - 16));
+    trim_after_free(arena);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+void sf_free(void *pp) {
+    trace(SF_TRACE_FREE, pp, 0, 0);
+    prof_free(pp);
+    free_untraced(pp);
+}
+
+void sf_free_sized(void *pp, size_t size) {
+    if(pp == NULL) {
+        abort();
+    }
+    trace(SF_TRACE_FREE, pp, 0, size);
+    prof_free(pp);
+
+    sf_huge* huge = huge_of(pp);
+    if(huge != NULL) {
+        if((huge->block.header >> 32) != size) {
+            abort();
+        }
+        huge_free(huge);
+        return;
+    }
+
+    sf_arena* arena = arena_of(pp);
+    sf_slab* slab = size <= SLAB_MAX_OBJ ? slab_of(arena, pp) : NULL;
+    if(slab != NULL) {
+        if(slab->objSize == 0 ? (*(uint32_t*) (pp - 4) >> 16) != size : size > slab->objSize) {
+            abort();
+        }
+        if(is_remote(arena) && remote_put(arena, pp)) {
+            return;
+        }
+        pthread_mutex_lock(&arena->lock);
+        slab_free(arena, slab, pp);
+        pthread_mutex_unlock(&arena->lock);
+        return;
+    }
+
+    //the header alone has to agree with size: allocated and not queued, the same payload, and the block padding
+    //gives it, or 16 bytes more where split would have left a splinter
+    sf_block* block = (sf_block*) (pp - 16);
+    sf_header header = block->header;
+    size_t blockSize = header & MAX_BLK_SIZE;
+    if(((uintptr_t) pp) % 16 != 0 || block <= arena->prologue || block >= arena->epilogue ||
+       (header & 0x8) == 0 || (header & 0x1) != 0 || (header >> 32) != size || blockSize < pad(size) ||
+       blockSize > pad(size) + 16) {
+        abort();
+    }
+
+    if(is_remote(arena) && remote_put(arena, pp)) {
+        return;
+    }
+    if(cpuCacheLimit != 0 && cpu_cache_put(arena, pp)) {
+        return;
+    }
+    if(tcacheLimit != 0 && tcache_put(arena, pp)) {
+        return;
+    }
+
+    pthread_mutex_lock(&arena->lock);
+#ifdef DEBUG
+    if(isInvalidPointer(arena, pp)) {
+        abort();
+    }
+#endif
+    heap_free(arena, block);
+    trim_after_free(arena);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+static void* realloc_untraced(void *pp, size_t rsize) {
+    sf_huge* huge = huge_of(pp);
+    if(huge != NULL) {
+        return huge_realloc(huge, rsize);
+    }
+
+    sf_arena* arena = arena_of(pp);
+    sf_slab* slab = slab_of(arena, pp);
+    if(slab != NULL && slab->objSize == 0) {
+        sf_cpage* page = (sf_cpage*) slab;
+        pthread_mutex_lock(&arena->lock);
+        uint32_t offset = compact_block(page, pp);
+        if(offset == 0) {
+            sf_errno = EINVAL;
+            abort();
+        }
+        uint32_t header = CPAGE_WORD(page, offset);
+        size_t usable = (header & 0xFFF0) - 4;
+        if(rsize <= usable && rsize != 0) { //shrinking or growing within the block
+            arena->currPayload += rsize - (header >> 16);
+            if(arena->currPayload > arena->maxPayload) {
+                arena->maxPayload = arena->currPayload;
+            }
+            CPAGE_WORD(page, offset) = (uint32_t) rsize << 16 | (header & 0xFFFF);
+            pthread_mutex_unlock(&arena->lock);
+            return pp;
+        }
+        pthread_mutex_unlock(&arena->lock);
+
+        void* payload = rsize == 0 ? NULL : malloc_untraced(rsize);
+        if(payload == NULL && rsize != 0) {
+            return NULL;
+        }
+        if(payload != NULL) {
+            memcpy(payload, pp, header >> 16);
+        }
+        free_untraced(pp);
+        return payload;
+    }
+    if(slab != NULL) {
+        pthread_mutex_lock(&arena->lock);
+        if(slab_slot(slab, pp) < 0) {
+            sf_errno = EINVAL;
+            abort();
+        }
+        pthread_mutex_unlock(&arena->lock);
+
+        if(rsize <= slab->objSize && rsize != 0) { //shrinking or growing within the object
+            return pp;
+        }
+
+        void* payload = rsize == 0 ? NULL : malloc_untraced(rsize);
+        if(payload == NULL && rsize != 0) {
+            return NULL;
+        }
+        if(payload != NULL) {
+            memcpy(payload, pp, slab->objSize);
+        }
+        free_untraced(pp);
+        return payload;
+    }
+
+    pthread_mutex_lock(&arena->lock);
+    if(isInvalidPointer(arena, pp)) {
+        sf_errno = EINVAL;
+        abort();
+    }
+    pthread_mutex_unlock(&arena->lock);
+
+    if(rsize == 0) {
+        free_untraced(pp);
+        return NULL;
+    }
+    if(rsize > MAX_BLK_SIZE - 16 && (hugeThreshold == 0 || rsize < hugeThreshold)) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    //New Requested block size min, past any block for a size only a mapping can hold
+    size_t newSize = rsize > MAX_BLK_SIZE - 16 ? SIZE_MAX : pad(rsize);
+
+    //Get current block
+    sf_block* oldBlock = (sf_block*) (pp - 16); //Get to root address from payload
+    size_t oldSize = oldBlock->header & MAX_BLK_SIZE;
+    size_t oldPayloadSize = oldBlock->header >> 32;
+
+    //if same size, just record the new payload size and return the pointer back, else get new pointer
+    if(newSize == oldSize) {
+        pthread_mutex_lock(&arena->lock);
+        arena->currPayload += rsize - oldPayloadSize;
+        if(arena->currPayload > arena->maxPayload) {
+            arena->maxPayload = arena->currPayload;
+        }
+        oldBlock->header = (rsize << 32) | (oldBlock->header & 0xFFFFFFFF);
+        alloc_footer(oldBlock, oldBlock->header);
+        pthread_mutex_unlock(&arena->lock);
+        return pp;
+    }
+
+    //new block is larger, grow it where it is if the blocks after it allow and it is not to be mapped
+    if(oldSize < newSize) {
+        int grown = -1;
+        if(hugeThreshold == 0 || rsize < hugeThreshold) {
+            pthread_mutex_lock(&arena->lock);
+            grown = grow_in_place(arena, oldBlock, newSize, rsize);
+            pthread_mutex_unlock(&arena->lock);
+        }
+        if(grown == 0) {
+            return pp;
+        }
+
+        //last resort, move it
+        void* payload = malloc_untraced(rsize);
+        if(payload == NULL) {
+            return NULL;
+        }
+
+        payload = memcpy(payload, pp, oldSize - BLK_OVERHEAD); //all of it, sf_usable_size lets the caller use it
+        free_untraced(pp);
+        return payload;
+    }
+
+    //new block is smaller
+    pthread_mutex_lock(&arena->lock);
+    arena->currPayload -= oldPayloadSize;
+    arena->memUsed -= oldSize;
+    sf_block* newBlock = (sf_block*) split(arena, oldBlock, newSize, rsize);
+
+    arena->currPayload += newBlock->header >> 32;
+    arena->memUsed += newBlock->header & MAX_BLK_SIZE;
+    pthread_mutex_unlock(&arena->lock);
+    return newBlock->body.payload;
+}
+
+void *sf_realloc(void *pp, size_t rsize) {
+    //out of profTable before the old block can be handed out again, back in once it is known where it went
+    prof_sample* sample = prof_detach(pp);
+    void* payload;
+    if(__atomic_load_n(&traceFd, __ATOMIC_RELAXED) < 0) {
+        payload = realloc_untraced(pp, rsize);
+    } else {
+        //the old block may be handed out again before this returns, so no record can come between
+        pthread_mutex_lock(&traceLock);
+        payload = realloc_untraced(pp, rsize);
+        if(traceFd >= 0 && (payload != NULL || rsize == 0)) {
+            trace_put(SF_TRACE_REALLOC, pp, (uintptr_t) payload, rsize);
+        }
+        pthread_mutex_unlock(&traceLock);
+    }
+    prof_realloc(sample, payload, rsize);
+    return payload;
+}
+
+size_t sf_malloc_batch(size_t size, size_t n, void **out) {
+    size_t done = 0;
+    if(size == 0) {
+        return 0;
+    }
+
+    if(hugeThreshold != 0 && size >= hugeThreshold) {
+        sf_arena* arena = thread_arena();
+        while(done < n && (out[done] = huge_malloc(arena, size)) != NULL) {
+            trace(SF_TRACE_MALLOC, out[done], 0, size);
+            prof_alloc(out[done], size);
+            done++;
+        }
+        return done;
+    }
+
+    sf_arena* arena = thread_arena();
+    if(size <= compactMax || size <= slabMax) {
+        pthread_mutex_lock(&arena->lock);
+        remote_drain(arena);
+        while(done < n) {
+            out[done] = size <= compactMax ? compact_malloc(arena, size) : slab_malloc(arena, size);
+            if(out[done] == NULL) {
+                break;
+            }
+            done++;
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+    size_t slabbed = done;
+    for(size_t i = 0; i < slabbed; i++) {
+        trace(SF_TRACE_MALLOC, out[i], 0, size);
+        prof_alloc(out[i], size);
+    }
+    if(done == n) {
+        return done;
+    }
+    if(size > MAX_BLK_SIZE - 16) {
+        sf_errno = ENOMEM;
+        return done;
+    }
+
+    //one block holding as many of the rest as fit, carved up in place; halve the count if it does not fit
+    size_t sizeP = pad(size);
+    size_t count = MAX_BLK_SIZE / sizeP;
+    pthread_mutex_lock(&arena->lock);
+    remote_drain(arena);
+    while(done < n) {
+        if(count > n - done) {
+            count = n - done;
+        }
+        int err = sf_errno;
+        sf_block* block = heap_malloc(arena, count * sizeP, count * size);
+        if(block == NULL) {
+            if(count == 1) {
+                break;
+            }
+            sf_errno = err;
+            count = (count + 1) / 2;
+            continue;
+        }
+
+        //the last block takes whatever split left over
+        size_t total = block->header & MAX_BLK_SIZE;
+        sf_header prevAlloc = block->header & 0x4;
+        for(size_t i = 0; i < count; i++) {
+            sf_block* current = (sf_block*) ((void*) block + i * sizeP);
+            size_t blockSize = i == count - 1 ? total - i * sizeP : sizeP;
+            current->header = (size << 32) | blockSize | 0x8 | (i == 0 ? prevAlloc : 0x4);
+            alloc_footer(current, current->header);
+            out[done + i] = current->body.payload;
+        }
+        done += count;
+    }
+    pthread_mutex_unlock(&arena->lock);
+
+    for(size_t i = slabbed; i < done; i++) {
+        trace(SF_TRACE_MALLOC, out[i], 0, size);
+        prof_alloc(out[i], size);
+    }
+    return done;
+}
+
+static int cmp_address(const void* a, const void* b) {
+    uintptr_t x = (uintptr_t) *(void* const*) a, y = (uintptr_t) *(void* const*) b;
+    return (x > y) - (x < y);
+}
+
+void sf_free_batch(void **ptrs, size_t n) {
+    for(size_t i = 0; i < n; i++) {
+        trace(SF_TRACE_FREE, ptrs[i], 0, 0);
+        prof_free(ptrs[i]);
+    }
+
+    //mapped blocks and blocks of slab or compact pages go one by one, heap blocks are gathered at the front of ptrs
+    size_t m = 0;
+    for(size_t i = 0; i < n; i++) {
+        void* pp = ptrs[i];
+        if(pp == NULL) {
+            abort();
+        }
+        sf_huge* huge = huge_of(pp);
+        sf_arena* arena = arena_of(pp);
+        sf_slab* slab = huge == NULL ? slab_of(arena, pp) : NULL;
+        if(huge != NULL) {
+            huge_free(huge);
+        } else if(slab != NULL) {
+            pthread_mutex_lock(&arena->lock);
+            slab_free(arena, slab, pp);
+            pthread_mutex_unlock(&arena->lock);
+        } else {
+            ptrs[m++] = pp;
+        }
+    }
+
+    //in address order, every run of adjacent blocks is joined into one and freed with a single heap_free;
+    //the blocks after the first lose their header and the footer in front of it, as coalesce does,
+    //or a second free of one of them would still find an allocated block there
+    qsort(ptrs, m, sizeof(void*), cmp_address);
+    size_t i = 0;
+    while(i < m) {
+        sf_arena* arena = arena_of(ptrs[i]);
+        pthread_mutex_lock(&arena->lock);
+        while(i < m && arena_of(ptrs[i]) == arena) {
+            sf_block* run = NULL;
+            size_t runSize = 0, runPayload = 0;
+            for(; i < m && arena_of(ptrs[i]) == arena; i++) {
+                sf_block* block = (sf_block*) (ptrs[i] - 16);
+                size_t blockSize = block->header & MAX_BLK_SIZE, payload = block->header >> 32;
+                //a run ends at a gap, or before its header could no longer hold its size or payload
+                if(run != NULL && ((void*) block != (void*) run + runSize || runSize + blockSize > MAX_BLK_SIZE ||
+                                   runPayload + payload > 0xFFFFFFFF)) {
+                    break;
+                }
+                if(isInvalidPointer(arena, ptrs[i]) || tcache_holds(&threadCache, block) || cpu_cache_holds(block) ||
+                   (i > 0 && ptrs[i] == ptrs[i - 1])) {
+                    abort();
+                }
+                runSize += blockSize;
+                runPayload += payload;
+                if(run == NULL) {
+                    run = block;
+                } else {
+                    block->prev_footer = 0x0;
+                    block->header = 0x0;
+                }
+            }
+            run->header = (runPayload << 32) | runSize | 0x8 | (run->header & 0x4);
+            heap_free(arena, run);
+        }
+        trim_after_free(arena);
+        pthread_mutex_unlock(&arena->lock);
+    }
+}
+
+void *sf_calloc(size_t nmemb, size_t size) {
+    size_t total;
+    if(__builtin_mul_overflow(nmemb, size, &total)) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+    if(total == 0) {
+        return NULL;
+    }
+
+    if(hugeThreshold != 0 && total >= hugeThreshold) {
+        void* payload = huge_malloc(thread_arena(), total); //a new mapping is zero
+        if(payload != NULL) {
+            trace(SF_TRACE_CALLOC, payload, 0, total);
+            prof_alloc(payload, total);
+        }
+        return payload;
+    }
+    if(total > MAX_BLK_SIZE - 16) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    //slab slots, compact blocks and cached blocks are always recycled
+    size_t sizeP = pad(total);
+    if(total <= slabMax || total <= compactMax || (sizeP <= TCACHE_MAX_BLK && (tcacheLimit != 0 || cpuCacheLimit != 0))) {
+        void* payload = malloc_untraced(total);
+        if(payload == NULL) {
+            return NULL;
+        }
+        trace(SF_TRACE_CALLOC, payload, 0, total);
+        prof_alloc(payload, total);
+        return memset(payload, 0, total);
+    }
+
+    sf_arena* arena = thread_arena();
+    pthread_mutex_lock(&arena->lock);
+    remote_drain(arena);
+    char* fresh = arena->fresh;
+    sf_block* allocated = heap_malloc(arena, sizeP, total);
+    pthread_mutex_unlock(&arena->lock);
+    if(allocated == NULL) {
+        return NULL;
+    }
+
+    //only clear up to the header and links of the free block the fresh memory started with
+    char* payload = (char*) allocated->body.payload;
+    trace(SF_TRACE_CALLOC, payload, 0, total);
+    prof_alloc(payload, total);
+    size_t clear = total;
+    if(fresh != NULL) {
+        char* zero = (fresh > (char*) allocated ? fresh : (char*) allocated) + 32;
+        if(zero < payload + total) {
+            clear = zero - payload;
+        }
+    }
+#if !SF_FOOTERS
+    //the last row was the footer of the free block, the top of the heap if it was fresh
+    size_t last = (allocated->header & MAX_BLK_SIZE) - 16;
+    if(clear < total && total > last) {
+        memset(payload + last, 0, total - last);
+    }
+#endif
+    return memset(payload, 0, clear);
+}
+
+static void* memalign_untraced(size_t align, size_t size) {
+    if(align == 0 || (align & (align - 1)) != 0) {
+        sf_errno = EINVAL;
+        return NULL;
+    }
+    if(align <= 16) { //every payload is
+        return malloc_untraced(size);
+    }
+    if(size == 0) {
+        return NULL;
+    }
+
+    //a mapped block's payload sits 32 bytes into its first page
+    if(hugeThreshold != 0 && size >= hugeThreshold && align <= offsetof(sf_huge, block.body)) {
+        return huge_malloc(thread_arena(), size);
+    }
+
+    //the padded size plus the slack in front of it must still fit a block
+    if(align > MAX_BLK_SIZE || size > MAX_BLK_SIZE - align - 64) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    sf_arena* arena = thread_arena();
+    pthread_mutex_lock(&arena->lock);
+    remote_drain(arena);
+    sf_block* allocated = heap_memalign(arena, align, pad(size), size);
+    pthread_mutex_unlock(&arena->lock);
+
+    if(allocated == NULL) {
+        return NULL;
+    }
+    return allocated->body.payload;
+}
+
+void *sf_memalign(size_t align, size_t size) {
+    void* payload = memalign_untraced(align, size);
+    if(payload != NULL) {
+        trace(SF_TRACE_MEMALIGN, payload, align, size);
+        prof_alloc(payload, size);
+    }
+    return payload;
+}
+
+void *sf_aligned_alloc(size_t align, size_t size) {
+    return sf_memalign(align, size);
+}
+
+int sf_posix_memalign(void **memptr, size_t align, size_t size) {
+    if(align == 0 || align % sizeof(void*) != 0 || (align & (align - 1)) != 0) {
+        return EINVAL;
+    }
+    if(size == 0) {
+        *memptr = NULL;
+        return 0;
+    }
+
+    int savedErrno = sf_errno;
+    void* payload = sf_memalign(align, size); //records the allocation
+    if(payload == NULL) {
+        int error = sf_errno;
+        sf_errno = savedErrno;
+        return error;
+    }
+    *memptr = payload;
+    return 0;
+}
+
+size_t sf_usable_size(void *pp) {
+    sf_huge* huge = huge_of(pp);
+    if(huge != NULL) {
+        return huge->block.prev_footer - offsetof(sf_huge, block.body);
+    }
+    sf_arena* arena = arena_of(pp);
+    sf_slab* slab = slab_of(arena, pp);
+    if(slab != NULL && slab->objSize == 0) {
+        return (*(uint32_t*) (pp - 4) & 0xFFF0) - 4;
+    }
+    if(slab != NULL) {
+        return slab->objSize;
+    }
+    return (((sf_block*) (pp - 16))->header & MAX_BLK_SIZE) - BLK_OVERHEAD;
+}
+
+static pid_t lockPid; //process that called sf_lock_all, to tell the child of a fork from the parent
+
+void sf_lock_all() {
+    pthread_mutex_lock(&traceLock);
+    pthread_mutex_lock(&profLock);
+    lockPid = getpid();
+    if(traceFd >= 0) { //a child must not write the parent's records again
+        trace_flush();
+    }
+    pthread_once(&arenaOnce, arena_init_all);
+    for(int i = 0; i < SF_MAX_ARENAS; i++) {
+        pthread_mutex_lock(&arenas[i].lock);
+    }
+}
+
+void sf_unlock_all() {
+    for(int i = SF_MAX_ARENAS - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+    pthread_mutex_unlock(&profLock);
+    if(traceFd >= 0 && getpid() != tracePid) { //the trace belongs to the parent
+        close(traceFd);
+        traceFd = -1;
+    }
+    if(getpid() != lockPid) { //a recursive mutex only unlocks for its owner thread, which the child lacks
+        traceLock = (pthread_mutex_t) PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+    } else {
+        pthread_mutex_unlock(&traceLock);
+    }
+}
+
+int sf_trace_start(const char *path) {
+    pthread_mutex_lock(&traceLock);
+    if(traceFd >= 0) {
+        pthread_mutex_unlock(&traceLock);
+        sf_errno = EBUSY;
+        return -1;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0 || write(fd, SF_TRACE_MAGIC, 8) != 8) {
+        sf_errno = fd < 0 ? errno : EIO;
+        if(fd >= 0) {
+            close(fd);
+        }
+        pthread_mutex_unlock(&traceLock);
+        return -1;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    traceStart = ts.tv_sec * 1000000000L + ts.tv_nsec;
+    tracePid = getpid();
+    traceCount = 0;
+    __atomic_store_n(&traceFd, fd, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&traceLock);
+    return 0;
+}
+
+void sf_trace_stop() {
+    pthread_mutex_lock(&traceLock);
+    if(traceFd >= 0) {
+        trace_flush();
+        close(traceFd);
+        __atomic_store_n(&traceFd, -1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&traceLock);
+}
+
+size_t sf_prof_rate(size_t bytes) {
+    pthread_mutex_lock(&profLock);
+    if(bytes != 0 && prof_map_table() < 0) {
+        pthread_mutex_unlock(&profLock);
+        sf_errno = ENOMEM;
+        return profRate;
+    }
+    size_t old = profRate;
+    if(bytes != 0) {
+        profLastRate = bytes;
+    }
+    __atomic_store_n(&profRate, bytes, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&profLock);
+
+    if(bytes != 0) { //the first backtrace loads the unwinder, which allocates
+        void* stack[PROF_DEPTH];
+        inProfiler = 1;
+        backtrace(stack, PROF_DEPTH);
+        inProfiler = 0;
+    }
+    prof_arm(bytes); //other threads notice at their next sample or recheck
+    return old;
+}
+
+//A call stack in profTable, and what its samples add up to
+typedef struct prof_site {
+    prof_sample* first; //one of its samples, for the stack
+    size_t samples, bytes;
+    double objects, estimate; //estimated live objects and bytes the samples stand for
+} prof_site;
+
+static int cmp_site(const void* a, const void* b) {
+    double x = ((const prof_site*) a)->estimate, y = ((const prof_site*) b)->estimate;
+    return (x < y) - (x > y);
+}
+
+//The live samples grouped by call stack, profLock held; *count is set to the number of sites
+static prof_site* prof_sites(size_t* count, size_t* mapped) {
+    size_t cap = 16;
+    while(cap < 2 * profSamples) {
+        cap <<= 1;
+    }
+    *mapped = cap * sizeof(prof_site);
+    prof_site* sites = mmap(NULL, *mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(sites == MAP_FAILED) {
+        return NULL;
+    }
+
+    for(size_t b = 0; profTable != NULL && b < PROF_BUCKETS; b++) {
+        for(prof_sample* sample = profTable[b]; sample != NULL; sample = sample->next) {
+            uint64_t hash = sample->depth;
+            for(int f = 0; f < sample->depth; f++) {
+                hash = (hash ^ (uintptr_t) sample->stack[f]) * 0x100000001B3ULL;
+            }
+            size_t i = hash & (cap - 1);
+            while(sites[i].first != NULL && (sites[i].first->depth != sample->depth ||
+                  memcmp(sites[i].first->stack, sample->stack, sample->depth * sizeof(void*)) != 0)) {
+                i = (i + 1) & (cap - 1);
+            }
+            //each sample stands for 1 / the chance that an allocation of its size was sampled
+            double chance = 1 - exp(-(double) sample->size / sample->rate);
+            sites[i].first = sample;
+            sites[i].samples++;
+            sites[i].bytes += sample->size;
+            sites[i].objects += 1 / chance;
+            sites[i].estimate += sample->size / chance;
+        }
+    }
+
+    size_t n = 0;
+    for(size_t i = 0; i < cap; i++) {
+        if(sites[i].first != NULL) {
+            sites[n++] = sites[i];
+        }
+    }
+    qsort(sites, n, sizeof(prof_site), cmp_site);
+    *count = n;
+    return sites;
+}
+
+static int prof_write_text(int fd, prof_site* sites, size_t n) {
+    char line[256];
+    double objects = 0, estimate = 0;
+    for(size_t i = 0; i < n; i++) {
+        objects += sites[i].objects;
+        estimate += sites[i].estimate;
+    }
+    int err = write_all(fd, line, snprintf(line, sizeof(line),
+                        "sfmm heap profile: %zu samples, about %.0f bytes in %.0f objects live\n\n",
+                        profSamples, estimate, objects));
+    for(size_t i = 0; i < n && err == 0; i++) {
+        err = write_all(fd, line, snprintf(line, sizeof(line), "%.0f bytes in %.0f objects (%zu samples)\n",
+                                           sites[i].estimate, sites[i].objects, sites[i].samples));
+        backtrace_symbols_fd(sites[i].first->stack, sites[i].first->depth, fd);
+        err |= write_all(fd, "\n", 1);
+    }
+    return err;
+}
+
+static int prof_write_pprof(int fd, prof_site* sites, size_t n) {
+    char line[128 + 19 * PROF_DEPTH];
+    size_t samples = 0, bytes = 0;
+    for(size_t i = 0; i < n; i++) {
+        samples += sites[i].samples;
+        bytes += sites[i].bytes;
+    }
+    int err = write_all(fd, line, snprintf(line, sizeof(line), "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+                                           samples, bytes, samples, bytes, profLastRate));
+    for(size_t i = 0; i < n && err == 0; i++) {
+        int len = snprintf(line, sizeof(line), "%zu: %zu [%zu: %zu] @", sites[i].samples, sites[i].bytes,
+                           sites[i].samples, sites[i].bytes);
+        for(int f = 0; f < sites[i].first->depth; f++) {
+            len += snprintf(line + len, sizeof(line) - len, " %p", sites[i].first->stack[f]);
+        }
+        line[len++] = '\n';
+        err = write_all(fd, line, len);
+    }
+
+    //pprof finds the symbols of the addresses through the mappings
+    err |= write_all(fd, "\nMAPPED_LIBRARIES:\n", 19);
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if(maps < 0) {
+        return -1;
+    }
+    ssize_t got;
+    while(err == 0 && (got = read(maps, line, sizeof(line))) > 0) {
+        err = write_all(fd, line, got);
+    }
+    close(maps);
+    return err;
+}
+
+int sf_prof_dump(const char *path, int format) {
+    if(format != SF_PROF_TEXT && format != SF_PROF_PPROF) {
+        sf_errno = EINVAL;
+        return -1;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        sf_errno = errno;
+        return -1;
+    }
+
+    inProfiler = 1; //qsort and the symbol lookup can allocate
+    pthread_mutex_lock(&profLock);
+    size_t n, mapped;
+    prof_site* sites = prof_sites(&n, &mapped);
+    int err = sites == NULL ? -1 : format == SF_PROF_TEXT ? prof_write_text(fd, sites, n) : prof_write_pprof(fd, sites, n);
+    pthread_mutex_unlock(&profLock);
+    inProfiler = 0;
+    if(sites != NULL) {
+        munmap(sites, mapped);
+    }
+    if(close(fd) != 0 || err != 0) {
+        sf_errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+size_t sf_cpu_cache_limit(size_t bytes) {
+    pthread_once(&cpuCacheOnce, cpu_cache_init);
+#if CPU_CACHE_RSEQ
+    if(cpuCaches != NULL) {
+        pthread_mutex_lock(&cpuCacheLock);
+        size_t old = cpuCacheLimit;
+        //publish the new caps, then fence every CPU before draining: a push that read the old caps is
+        //aborted by the fence and starts over with the new ones, so none lands after the drain passed
+        cpu_cache_caps(bytes);
+        __atomic_store_n(&cpuCacheLimit, bytes, __ATOMIC_SEQ_CST);
+        if(bytes < old) {
+            if(cpuFence) {
+                syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, 0, 0);
+            }
+            if(cpu_cache_drain() != 0) {
+                sf_errno = EAGAIN; //some CPU keeps blocks above the new limit until its threads free again
+            }
+        }
+        pthread_mutex_unlock(&cpuCacheLock);
+        return old;
+    }
+#endif
+    return sf_tcache_limit(bytes);
+}
+
+int sf_remote_free(int on) {
+    int old = remoteFree;
+    remoteFree = on != 0;
+    return old;
+}
+
+size_t sf_tcache_limit(size_t bytes) {
+    size_t old = tcacheLimit;
+    tcacheLimit = bytes;
+    if(threadCache.bytes > bytes) { //the calling thread should not sit above its new limit
+        sf_tcache_flush();
+    }
+    return old;
+}
+
+void sf_tcache_flush() {
+    tcache_flush(&threadCache);
+}
+
+size_t sf_slab_limit(size_t size) {
+    size_t old = slabMax;
+    slabMax = size > SLAB_MAX_OBJ ? SLAB_MAX_OBJ : size;
+    return old;
+}
+
+size_t sf_compact_limit(size_t size) {
+    size_t old = compactMax;
+    compactMax = size > COMPACT_MAX_OBJ ? COMPACT_MAX_OBJ : size;
+    return old;
+}
+
+int sf_arena_config(int count, int policy) {
+    if(count < 1 || count > SF_MAX_ARENAS || (policy != SF_ARENA_ROUND_ROBIN && policy != SF_ARENA_BY_CPU)) {
+        sf_errno = EINVAL;
+        return -1;
+    }
+
+    arenaCount = count;
+    arenaPolicy = policy;
+    return 0;
+}
+
+size_t sf_trim(size_t keep) {
+    size_t released = 0;
+    pthread_once(&arenaOnce, arena_init_all);
+    for(int i = 0; i < SF_MAX_ARENAS; i++) {
+        pthread_mutex_lock(&arenas[i].lock);
+        remote_drain(&arenas[i]);
+        released += arena_trim(&arenas[i], keep);
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+    return released;
+}
+
+size_t sf_trim_threshold(size_t bytes) {
+    size_t old = trimThreshold;
+    trimThreshold = bytes;
+    return old;
+}
+
+size_t sf_released() {
+    size_t released = 0;
+    pthread_once(&arenaOnce, arena_init_all);
+    for(int i = 0; i < SF_MAX_ARENAS; i++) {
+        pthread_mutex_lock(&arenas[i].lock);
+        released += arenas[i].released;
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+    return released;
+}
+
+int sf_thp(int on) {
+    int old = thp;
+    thp = on != 0;
+    return old;
+}
+
+int sf_heap_growth(size_t minChunk, size_t maxChunk) {
+    if(minChunk == 0 || maxChunk < minChunk) {
+        sf_errno = EINVAL;
+        return -1;
+    }
+
+    growMin = minChunk;
+    growMax = maxChunk;
+    return 0;
+}
+
+size_t sf_mmap_threshold(size_t bytes) {
+    size_t old = hugeThreshold;
+    hugeThreshold = bytes;
+    return old;
+}
+
+int sf_set_policy(int policy) {
+    if(policy != SF_POLICY_SEGREGATED && policy != SF_POLICY_TLSF) {
+        sf_errno = EINVAL;
+        return -1;
+    }
+
+    freePolicy = policy;
+    return 0;
+}
+
+double sf_fragmentation() {
+    size_t currPayload = 0, memUsed = 0;
+    pthread_once(&arenaOnce, arena_init_all);
+    for(int i = 0; i < SF_MAX_ARENAS; i++) {
+        pthread_mutex_lock(&arenas[i].lock);
+        tcache_merge_stats(&threadCache, &arenas[i]);
+        currPayload += arenas[i].currPayload + arenas[i].hugePayload;
+        memUsed += arenas[i].memUsed + arenas[i].hugeMapped;
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+
+    if(memUsed == 0) return 0.0;
+    return (double) currPayload / (double) memUsed;
+}
+
+//Huge pages backing the reservation of arenas 1 and up, from AnonHugePages in /proc/self/smaps
+static size_t thp_pages() {
+    int fd = arenaBase == NULL ? -1 : open("/proc/self/smaps", O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return 0;
+    }
+    uintptr_t lo = (uintptr_t) arenaBase, hi = lo + (SF_MAX_ARENAS - 1) * SF_ARENA_RESERVE;
+    char buf[4096];
+    size_t have = 0, kb = 0;
+    int inside = 0; //whether the mapping being described lies in the reservation
+    ssize_t got;
+    while((got = read(fd, buf + have, sizeof(buf) - have)) > 0) {
+        have += got;
+        char* line = buf;
+        char* nl;
+        while((nl = memchr(line, '\n', buf + have - line)) != NULL) {
+            *nl = '\0';
+            char* end;
+            uintptr_t start = strtoul(line, &end, 16);
+            if(end > line && *end == '-') { //a mapping's address range starts its lines
+                inside = start >= lo && start < hi;
+            } else if(inside && strncmp(line, "AnonHugePages:", 14) == 0) {
+                kb += strtoul(line + 14, NULL, 10);
+            }
+            line = nl + 1;
+        }
+        have = line == buf ? 0 : buf + have - line; //a line longer than buf is dropped
+        memmove(buf, line, have);
+    }
+    close(fd);
+    return kb / (THP_SZ / 1024);
+}
+
+void sf_stats(struct sf_stats *out) {
+    memset(out, 0, sizeof(*out));
+    pthread_once(&arenaOnce, arena_init_all);
+    for(int i = 0; i < SF_MAX_ARENAS; i++) {
+        sf_arena* arena = &arenas[i];
+        pthread_mutex_lock(&arena->lock);
+        remote_drain(arena);
+#if SF_STATS
+        for(int c = 0; c < NUM_FREE_LISTS; c++) {
+            out->classes[c].mallocs += arena->stats.classes[c].mallocs;
+            out->classes[c].frees += arena->stats.classes[c].frees;
+            out->classes[c].splits += arena->stats.classes[c].splits;
+            out->classes[c].coalesces += arena->stats.classes[c].coalesces;
+            out->classes[c].searches += arena->stats.classes[c].searches;
+            out->classes[c].search_nodes += arena->stats.classes[c].search_nodes;
+        }
+        out->extensions += arena->stats.extensions;
+        out->failed += arena->stats.failed;
+#endif
+        out->heap_size += arena->heapSize;
+        if(arena->listEmpty != 0) {
+            int lists = arena->policy == SF_POLICY_TLSF ? TLSF_LISTS : NUM_FREE_LISTS;
+            for(int l = 0; l < lists; l++) {
+                sf_block* sentinel = list_head(arena, l);
+                for(sf_block* bp = sentinel->body.links.next; bp != sentinel; bp = bp->body.links.next) {
+                    size_t size = bp->header & MAX_BLK_SIZE;
+                    out->classes[getIdx(size)].free_blocks++;
+                    out->classes[getIdx(size)].free_bytes += size;
+                }
+            }
+            if((arena->epilogue->header & 0x4) == 0) {
+                out->wilderness_size += arena->epilogue->prev_footer & MAX_BLK_SIZE;
+            }
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+    out->thp_pages = thp_pages();
+}
+
+double sf_utilization() {
+    size_t maxPayload = 0, heapSize = 0;
+    pthread_once(&arenaOnce, arena_init_all);
+    for(int i = 0; i < SF_MAX_ARENAS; i++) {
+        pthread_mutex_lock(&arenas[i].lock);
+        tcache_merge_stats(&threadCache, &arenas[i]);
+        maxPayload += arenas[i].maxPayload;
+        heapSize += arenas[i].heapSize;
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+
+    if(heapSize == 0) return 0.0;
+    return (double) maxPayload / (double) heapSize;
+}
@@ -67,9 +67,11 @@ Test(sf_memsuite_grading, realloc_larger, .timeout=TEST_TIMEOUT)
     _assert_nonnull_payload_pointer(y);
     _assert_block_info((sf_block *)((char *)y - 16), 1, 1040);
 
-    _assert_free_block_count(224, 1);
+    cr_assert_eq(x, y, "realloc into the wilderness did not grow the block in place");
 
-    _assert_free_block_count(2784, 1);
+    _assert_free_block_count(0, 1);
+
+    _assert_free_block_count(3008, 1);
 
     _assert_errno_eq(0);
 }
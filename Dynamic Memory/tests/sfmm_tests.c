@@ -1,6 +1,8 @@
 #include <criterion/criterion.h>
 #include <errno.h>
 #include <signal.h>
+#include <pthread.h>
+#include <string.h>
 #include "debug.h"
 #include "sfmm.h"
 #define TEST_TIMEOUT 15
@@ -188,4 +190,734 @@ Test(sfmm_basecode_suite, realloc_smaller_block_free_block, .timeout = TEST_TIME
 	// This block will go into the freelist and be coalesced.
 	assert_free_block_count(0, 1);
 	assert_free_block_count(4016, 1);
-}
\ No newline at end of file
+}
+
+Test(sfmm_basecode_suite, tcache_reuse, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	sf_tcache_limit(4096);
+	void *x = sf_malloc(100);
+	sf_free(x);
+
+	// The freed block stays in the thread cache and is handed straight back.
+	void *y = sf_malloc(100);
+	cr_assert(x == y, "Cached block was not reused (x=%p, y=%p)!", x, y);
+
+	sf_free(y);
+	sf_tcache_flush();
+	sf_tcache_limit(0);
+
+	// Once flushed, the whole refill batch coalesces back into the wilderness.
+	assert_free_block_count(0, 1);
+	assert_free_block_count(4048, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, tcache_payload_stats, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	sf_tcache_limit(4096);
+	void *x = sf_malloc(100);
+	void *y = sf_malloc(100);
+	sf_free(x);
+	x = sf_malloc(60);
+
+	// Payload that went through the cache without a lock is counted as soon as the thread asks,
+	// against the two batches of 8 blocks of 128 and 80 bytes the refills carved.
+	double frag = sf_fragmentation();
+	cr_assert(frag == 160.0 / (8 * 128 + 8 * 80), "Cached payload not counted (%f)!", frag);
+	// The peak of 200 came and went between two folds, the last of which saw 160.
+	cr_assert(sf_utilization() == 160.0 / 4096, "Peak payload not counted (%f)!", sf_utilization());
+	sf_free(x);
+	sf_free(y);
+	cr_assert(sf_fragmentation() == 0.0, "Freed payload still counted (%f)!", sf_fragmentation());
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+static void *arena_thread_malloc(void *arg) {
+	return sf_malloc(200);
+}
+
+Test(sfmm_basecode_suite, arena_cross_thread_free, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	/* void *x = */ sf_malloc(8);
+
+	// The second thread to allocate is bound to a different arena than the main thread.
+	pthread_t tid;
+	void *y = NULL;
+	pthread_create(&tid, NULL, arena_thread_malloc, NULL);
+	pthread_join(tid, &y);
+	cr_assert_not_null(y, "y is NULL!");
+	cr_assert((char *)y < (char *)sf_mem_start() || (char *)y >= (char *)sf_mem_end(),
+		  "Second thread allocated from arena 0!");
+
+	// Freeing from another thread returns the block to its own arena, not to arena 0.
+	sf_free(y);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(4016, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, slab_small_objects, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	sf_slab_limit(128);
+	char *x = sf_malloc(1);
+	char *y = sf_malloc(16);
+	char *z = sf_malloc(17);
+
+	// Objects of one class sit back to back in a page-aligned slab, with no header in between.
+	cr_assert_not_null(x, "x is NULL!");
+	cr_assert(y == x + 16, "Slab objects are not adjacent (x=%p, y=%p)!", x, y);
+	cr_assert(((uintptr_t)x & (PAGE_SZ - 1)) == 64, "First object not at the start of a slab page!");
+	cr_assert(((uintptr_t)z & ~(PAGE_SZ - 1)) != ((uintptr_t)x & ~(PAGE_SZ - 1)),
+		  "Different size classes share a slab page!");
+
+	// A freed slot is the first one handed out again.
+	sf_free(x);
+	char *w = sf_malloc(8);
+	cr_assert(w == x, "Freed slab slot was not reused (x=%p, w=%p)!", x, w);
+
+	sf_free(w);
+	sf_free(y);
+	sf_free(z);
+	sf_slab_limit(0);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, compact_small_blocks, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	sf_compact_limit(128);
+	char *x = sf_malloc(1);
+	char *y = sf_malloc(12);
+	char *z = sf_malloc(13);
+
+	// A 4 byte header is all that separates blocks of a compact page, so up to 12 bytes take 16.
+	cr_assert_not_null(x, "x is NULL!");
+	cr_assert(((uintptr_t)x & (PAGE_SZ - 1)) == 64, "First block not at the start of a compact page!");
+	cr_assert(y == x + 16, "16 byte blocks are not adjacent (x=%p, y=%p)!", x, y);
+	cr_assert(z == y + 16, "Block after y is not adjacent (y=%p, z=%p)!", y, z);
+	cr_assert(sf_usable_size(x) == 12, "Usable size of x is %zu, not 12!", sf_usable_size(x));
+	cr_assert(sf_usable_size(z) == 28, "Usable size of z is %zu, not 28!", sf_usable_size(z));
+
+	// Freed neighbours coalesce, and the merged block is the first fit for a 32 byte block.
+	sf_free(x);
+	sf_free(y);
+	char *w = sf_malloc(20);
+	cr_assert(w == x, "Coalesced block was not reused (x=%p, w=%p)!", x, w);
+
+	// Growing within the block keeps it, past it the block moves.
+	cr_assert(sf_realloc(z, 28) == z, "Realloc within the block moved it!");
+	memset(z, 'z', 28);
+	char *v = sf_realloc(z, 29);
+	cr_assert(v != z, "Realloc past the block did not move it!");
+	cr_assert(v[27] == 'z', "Realloc did not copy the payload!");
+
+	sf_free_sized(w, 20);
+	sf_free(v);
+	sf_compact_limit(0);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, search_smallest_nonempty_list, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *u = sf_malloc(200);
+	/* void *v = */ sf_malloc(8);
+	void *w = sf_malloc(500);
+	/* void *x = */ sf_malloc(8);
+
+	sf_free(u);
+	sf_free(w);
+	assert_free_list_size(4, 1);
+	assert_free_list_size(6, 1);
+
+	// The request is served from the first non-empty list that can hold it.
+	void *y = sf_malloc(100);
+	cr_assert(y == u, "Block not taken from the smallest suitable list (y=%p, u=%p)!", y, u);
+	assert_free_list_size(4, 0);
+	assert_free_list_size(6, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, tlsf_policy, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	cr_assert_eq(sf_set_policy(SF_POLICY_TLSF), 0, "TLSF policy was rejected!");
+	void *x = sf_malloc(40);
+	void *y = sf_malloc(200);
+	void *z = sf_malloc(1000);
+	void *w = sf_malloc(8);
+
+	// A block of 224 bytes is the first one in a list whose blocks all hold a 208 byte request.
+	sf_free(y);
+	void *v = sf_malloc(180);
+	cr_assert(v == y, "Freed block was not reused (y=%p, v=%p)!", y, v);
+
+	// TLSF keeps its own lists, and still coalesces everything back into one block.
+	sf_free(x);
+	sf_free(v);
+	sf_free(z);
+	sf_free(w);
+	assert_free_block_count(0, 0);
+	void *u = sf_malloc(4000);
+	cr_assert(u == x, "Free blocks were not coalesced (x=%p, u=%p)!", x, u);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+
+	cr_assert_eq(sf_set_policy(2), -1, "Invalid policy was accepted!");
+	cr_assert(sf_errno == EINVAL, "sf_errno is not EINVAL!");
+}
+
+Test(sfmm_basecode_suite, realloc_grow_in_place, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *x = sf_malloc(40);
+	void *y = sf_malloc(40);
+	void *z = sf_malloc(8);
+	sf_free(y);
+
+	// The free block after x is absorbed, which exactly covers the larger request.
+	void *x2 = sf_realloc(x, 100);
+	cr_assert(x2 == x, "Block did not grow in place (x=%p, x2=%p)!", x, x2);
+	cr_assert((((sf_block *)((char *)x - 16))->header & 0xfffffff0) == 128, "Grown block has the wrong size!");
+	assert_free_block_count(0, 1);
+
+	// The last block takes over the wilderness, and the heap is extended behind it.
+	void *z2 = sf_realloc(z, 6000);
+	cr_assert(z2 == z, "Block did not grow into the wilderness (z=%p, z2=%p)!", z, z2);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(2000, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, mmap_huge_block, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	sf_mmap_threshold(64 * 1024);
+	void *w = sf_malloc(100);
+	double util = sf_utilization();
+
+	// A request above the threshold is mapped on its own, even if the heap could never hold it.
+	char *x = sf_malloc(200000);
+	cr_assert_not_null(x, "x is NULL!");
+	cr_assert((void *)x < sf_mem_start() || (void *)x >= sf_mem_end(), "Huge block was put in the heap!");
+	cr_assert(sf_utilization() == util, "Huge block changed the heap utilization!");
+	memset(x, 'a', 200000);
+
+	// Growing it remaps, and keeps the contents.
+	char *y = sf_realloc(x, 400000);
+	cr_assert_not_null(y, "y is NULL!");
+	cr_assert(y[0] == 'a' && y[199999] == 'a', "Contents lost when growing a huge block!");
+	y[399999] = 'b';
+
+	sf_free(y);
+	sf_free(w);
+	assert_free_block_count(0, 1);
+	cr_assert(sf_fragmentation() == 0.0, "Freed huge block still counted as allocated!");
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, heap_growth_policy, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	cr_assert_eq(sf_heap_growth(2 * PAGE_SZ, 8 * PAGE_SZ), 0, "Growth policy was rejected!");
+
+	// The heap starts with the minimum chunk, and doubles once that is used up.
+	/* void *x = */ sf_malloc(100);
+	cr_assert_eq(sf_mem_end() - sf_mem_start(), 2 * PAGE_SZ, "Heap did not start with the minimum chunk!");
+	/* void *y = */ sf_malloc(2 * PAGE_SZ);
+	cr_assert_eq(sf_mem_end() - sf_mem_start(), 4 * PAGE_SZ, "Heap did not double!");
+
+	// A request beyond the cap gets exactly the pages it is short of, in one step.
+	/* void *z = */ sf_malloc(12 * PAGE_SZ);
+	cr_assert_eq(sf_mem_end() - sf_mem_start(), 15 * PAGE_SZ, "Heap did not grow by what was needed!");
+	assert_free_block_count(0, 1);
+	assert_free_block_count(3888, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+
+	cr_assert_eq(sf_heap_growth(0, PAGE_SZ), -1, "Empty minimum chunk was accepted!");
+	cr_assert(sf_errno == EINVAL, "sf_errno is not EINVAL!");
+}
+
+static void *arena_thread_trim(void *arg) {
+	char *x = sf_malloc(20 * PAGE_SZ);
+	memset(x, 'a', 20 * PAGE_SZ);
+	sf_free(x);
+	return NULL;
+}
+
+Test(sfmm_basecode_suite, trim_release_pages, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	char *x = sf_malloc(4 * PAGE_SZ);
+	/* void *y = */ sf_malloc(8);
+	memset(x, 'a', 4 * PAGE_SZ);
+	sf_free(x);
+
+	// The freed block keeps its place in the free lists, only whole pages inside it are given up.
+	size_t released = sf_trim(0);
+	cr_assert(released >= 3 * PAGE_SZ, "Too little released (%zu)!", released);
+	assert_free_block_count(4 * PAGE_SZ + 16, 1);
+	cr_assert(sf_released() == released, "Released bytes were not counted!");
+
+	// The block can be allocated and used again.
+	char *z = sf_malloc(4 * PAGE_SZ);
+	cr_assert(z == x, "Trimmed block was not reused (x=%p, z=%p)!", x, z);
+	memset(z, 'b', 4 * PAGE_SZ);
+
+	// The top of another arena's heap is unmapped down to what was asked to be kept.
+	pthread_t tid;
+	pthread_create(&tid, NULL, arena_thread_trim, NULL);
+	pthread_join(tid, NULL);
+	released = sf_trim(PAGE_SZ);
+	cr_assert(released >= 18 * PAGE_SZ, "Top of the heap was not trimmed (%zu)!", released);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, memalign_leading_slack, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	/* void *w = */ sf_malloc(8);
+	char *x = sf_memalign(256, 100);
+	cr_assert_not_null(x, "x is NULL!");
+	cr_assert(((uintptr_t)x & 255) == 0, "x is not 256 byte aligned (%p)!", x);
+	memset(x, 'a', 100);
+
+	// The space skipped to reach the boundary is a free block of its own, in front of x.
+	sf_block *bp = (sf_block *)(x - 16);
+	cr_assert((bp->header & 0x4) == 0, "Leading slack was not left free!");
+	assert_free_block_count(0, 2);
+
+	// Shrinking keeps the address, and the block is freed like any other.
+	cr_assert(sf_realloc(x, 40) == x, "Shrinking moved an aligned block!");
+	void *y = NULL;
+	cr_assert_eq(sf_posix_memalign(&y, 4096, 200), 0, "posix_memalign failed!");
+	cr_assert(((uintptr_t)y & 4095) == 0, "y is not page aligned (%p)!", y);
+	sf_free(y);
+	sf_free(x);
+	assert_free_block_count(0, 1);
+
+	cr_assert_eq(sf_posix_memalign(&y, 24, 200), EINVAL, "Alignment of 24 was accepted!");
+	cr_assert(sf_memalign(48, 200) == NULL && sf_errno == EINVAL, "sf_errno is not EINVAL!");
+}
+
+static int all_zero(char *p, size_t n) {
+	for(size_t i = 0; i < n; i++)
+		if(p[i] != 0)
+			return 0;
+	return 1;
+}
+
+static void *arena_thread_calloc(void *arg) {
+	// The first block comes from fresh pages, the second is the same block recycled.
+	char *x = sf_calloc(1000, 8);
+	if(x == NULL || !all_zero(x, 8000))
+		return NULL;
+	memset(x, 'a', 8000);
+	sf_free(x);
+	char *y = sf_calloc(8000, 1);
+	return y == x && all_zero(y, 8000) ? y : NULL;
+}
+
+Test(sfmm_basecode_suite, calloc_zeroed, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	char *x = sf_malloc(100);
+	memset(x, 'a', 100);
+	sf_free(x);
+
+	// A recycled block is cleared in full.
+	char *y = sf_calloc(10, 10);
+	cr_assert(y == x, "Freed block was not reused (x=%p, y=%p)!", x, y);
+	cr_assert(all_zero(y, 100), "Recycled block was not cleared!");
+
+	pthread_t tid;
+	void *z = NULL;
+	pthread_create(&tid, NULL, arena_thread_calloc, NULL);
+	pthread_join(tid, &z);
+	cr_assert_not_null(z, "Block in another arena was not zeroed!");
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+
+	cr_assert_null(sf_calloc(SIZE_MAX / 2, 3), "Overflowing request was not rejected!");
+	cr_assert(sf_errno == ENOMEM, "sf_errno is not ENOMEM!");
+}
+
+Test(sfmm_basecode_suite, batch_malloc_free, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *p[10];
+	cr_assert_eq(sf_malloc_batch(100, 10, p), 10, "Not every block was allocated!");
+
+	// The blocks are carved back to back out of the wilderness.
+	for(int i = 1; i < 10; i++)
+		cr_assert((char *)p[i] == (char *)p[i - 1] + 128, "Blocks %d and %d are not adjacent!", i - 1, i);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(4048 - 10 * 128, 1);
+	cr_assert(sf_fragmentation() == 1000.0 / 1280.0, "Payload of the batch was not counted!");
+
+	// Runs of neighbours are freed together, in whatever order they are given.
+	void *q[5] = { p[7], p[1], p[3], p[2], p[8] };
+	sf_free_batch(q, 5);
+	assert_free_block_count(0, 3);
+	assert_free_block_count(256, 1);
+	assert_free_block_count(384, 1);
+
+	void *r[5] = { p[9], p[0], p[6], p[4], p[5] };
+	sf_free_batch(r, 5);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(4048, 1);
+	cr_assert(sf_fragmentation() == 0.0, "Freed batch still counted as allocated!");
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, batch_free_inner_double_free, .timeout = TEST_TIMEOUT, .signal = SIGABRT) {
+	void *a = sf_malloc(40);
+	void *b = sf_malloc(40);
+	/* void *c = */ sf_malloc(40);
+	void *p[2] = { a, b };
+	sf_free_batch(p, 2);
+	// b was joined into the block freed at a, and is no longer a block of its own to free.
+	sf_free(b);
+}
+
+Test(sfmm_basecode_suite, free_sized, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *x = sf_malloc(100);
+	void *y = sf_calloc(25, 4);
+	void *z = sf_malloc(3000);
+
+	sf_free_sized(y, 100);
+	sf_free_sized(x, 100);
+	assert_free_block_count(0, 2);
+	assert_free_block_count(256, 1);
+	sf_free_sized(z, 3000);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(4048, 1);
+	cr_assert(sf_fragmentation() == 0.0, "Sized free did not update the statistics!");
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, free_sized_mismatch, .signal = SIGABRT, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *x = sf_malloc(100);
+	sf_free_sized(x, 200);
+	cr_assert_fail("SIGABRT should have been received");
+}
+
+Test(sfmm_basecode_suite, usable_size_kept_by_realloc, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	char *x = sf_malloc(100);
+	/* void *y = */ sf_malloc(8);
+	size_t usable = sf_usable_size(x);
+	cr_assert_eq(usable, 112, "Wrong usable size %zu!", usable);
+
+	// Every usable byte survives a move, not only the 100 that were asked for.
+	memset(x, 'a', usable);
+	char *z = sf_realloc(x, 500);
+	cr_assert(z != x, "Block was not moved!");
+	cr_assert(z[usable - 1] == 'a', "Usable bytes past the request were lost!");
+
+	cr_assert_null(sf_malloc(SIZE_MAX - 8), "Request too large for a block was served!");
+	cr_assert(sf_errno == ENOMEM, "sf_errno is not ENOMEM!");
+}
+
+Test(sfmm_basecode_suite, stats_counters, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	struct sf_stats st;
+	void *x = sf_malloc(100);
+	void *y = sf_malloc(100);
+	sf_free(x);
+
+	// Two 128 byte blocks (class 3) split off the 4048 byte wilderness (class 9), one given back.
+	sf_stats(&st);
+	cr_assert(st.classes[3].mallocs == 2 && st.classes[3].frees == 1, "Wrong malloc/free counts!");
+	cr_assert(st.classes[3].searches == 2, "Wrong search count!");
+	cr_assert(st.classes[9].splits == 2, "Wrong split count!");
+	cr_assert(st.classes[3].free_blocks == 1 && st.classes[3].free_bytes == 128, "Wrong free blocks!");
+	cr_assert(st.heap_size == 4096 && st.wilderness_size == 3792, "Wrong heap or wilderness size!");
+
+	sf_free(y);
+	sf_stats(&st);
+	size_t coalesces = 0;
+	for(int i = 0; i < NUM_FREE_LISTS; i++)
+		coalesces += st.classes[i].coalesces;
+	cr_assert(coalesces == 2, "Wrong coalesce count %zu!", coalesces);
+	cr_assert(st.classes[9].free_blocks == 1 && st.wilderness_size == 4048, "Heap did not coalesce!");
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, trace_records, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	const char *path = "/tmp/sfmm_trace_test.bin";
+	cr_assert(sf_trace_start(path) == 0, "sf_trace_start failed!");
+	void *x = sf_malloc(100);
+	void *y = sf_memalign(256, 40);
+	sf_free_sized(x, 100);
+	sf_free(y);
+	sf_trace_stop();
+
+	// The magic, then one record per call, in the order they were made.
+	char magic[8];
+	sf_trace_record rec[5];
+	FILE *f = fopen(path, "r");
+	cr_assert(f != NULL && fread(magic, 1, 8, f) == 8, "Trace not written!");
+	size_t n = fread(rec, sizeof(sf_trace_record), 5, f);
+	fclose(f);
+	unlink(path);
+	cr_assert(memcmp(magic, SF_TRACE_MAGIC, 8) == 0, "Wrong trace magic!");
+	cr_assert_eq(n, 4, "Wrong number of records (%zu)!", n);
+	cr_assert(rec[0].op == SF_TRACE_MALLOC && rec[0].id == (uintptr_t)x && rec[0].size == 100, "Wrong malloc record!");
+	cr_assert(rec[1].op == SF_TRACE_MEMALIGN && rec[1].id == (uintptr_t)y && rec[1].aux == 256 && rec[1].size == 40,
+		  "Wrong memalign record!");
+	cr_assert(rec[2].op == SF_TRACE_FREE && rec[2].id == (uintptr_t)x && rec[2].size == 100, "Wrong sized free record!");
+	cr_assert(rec[3].op == SF_TRACE_FREE && rec[3].id == (uintptr_t)y && rec[3].size == 0, "Wrong free record!");
+	cr_assert(rec[0].time <= rec[1].time && rec[1].time <= rec[2].time && rec[2].time <= rec[3].time,
+		  "Records out of order!");
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, prof_samples, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	char line[128];
+	const char *path = "/tmp/sfmm_prof_test.heap";
+	cr_assert(sf_prof_rate(1) == 0, "Profiling was on!");
+
+	// At a mean interval of 1 byte every allocation of 100 is sampled.
+	void *p[4];
+	for(int i = 0; i < 4; i++)
+		p[i] = sf_malloc(100);
+	sf_free(p[0]);
+	p[1] = sf_realloc(p[1], 200);
+	cr_assert(sf_prof_dump(path, SF_PROF_PPROF) == 0, "sf_prof_dump failed!");
+
+	FILE *f = fopen(path, "r");
+	cr_assert(f != NULL && fgets(line, sizeof(line), f) != NULL, "Profile not written!");
+	cr_assert(strcmp(line, "heap profile: 3: 400 [3: 400] @ heap_v2/1\n") == 0, "Wrong profile header %s", line);
+	cr_assert(fgets(line, sizeof(line), f) != NULL && strstr(line, "] @ 0x") != NULL, "No call stack!");
+	fclose(f);
+	unlink(path);
+
+	sf_prof_rate(0);
+	sf_free(p[1]);
+	sf_free(p[2]);
+	sf_free(p[3]);
+	cr_assert(sf_prof_dump(path, SF_PROF_TEXT) == 0, "sf_prof_dump failed!");
+	f = fopen(path, "r");
+	cr_assert(f != NULL && fgets(line, sizeof(line), f) != NULL, "Profile not written!");
+	cr_assert(strncmp(line, "sfmm heap profile: 0 samples", 28) == 0, "Freed blocks still sampled: %s", line);
+	fclose(f);
+	unlink(path);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, prof_rate_from_start, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	char line[128];
+	const char *path = "/tmp/sfmm_prof_start_test.heap";
+
+	// Built with -DSF_PROF_RATE, sampling is on before anything calls sf_prof_rate.
+	void *p[64];
+	for(int i = 0; i < 64; i++)
+		p[i] = sf_malloc(400);
+	size_t rate = sf_prof_rate(0);
+	cr_assert(sf_prof_dump(path, SF_PROF_TEXT) == 0, "sf_prof_dump failed!");
+	FILE *f = fopen(path, "r");
+	cr_assert(f != NULL && fgets(line, sizeof(line), f) != NULL, "Profile not written!");
+	fclose(f);
+	unlink(path);
+	int samples = -1;
+	cr_assert(sscanf(line, "sfmm heap profile: %d samples", &samples) == 1, "Wrong profile header %s", line);
+	if(rate == 0)
+		cr_assert(samples == 0, "Sampled with profiling off: %s", line);
+	else if(rate <= 1024)
+		cr_assert(samples > 0, "Nothing sampled at a rate of %zu: %s", rate, line);
+
+	for(int i = 0; i < 64; i++)
+		sf_free(p[i]);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+static void *remote_thread_free(void *arg) {
+	sf_free(arg);
+	return NULL;
+}
+
+Test(sfmm_basecode_suite, remote_free_queue, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	sf_remote_free(1);
+	void *x = sf_malloc(100);
+	/* void *y = */ sf_malloc(100);
+
+	// A thread with no arena of its own only queues the block, which stays allocated.
+	pthread_t tid;
+	pthread_create(&tid, NULL, remote_thread_free, x);
+	pthread_join(tid, NULL);
+	assert_free_block_count(128, 0);
+
+	// The main thread frees it for real on its next allocation.
+	void *z = sf_malloc(200);
+	cr_assert(z != x, "Queued block was handed out again!");
+	assert_free_block_count(128, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, remote_double_free, .timeout = TEST_TIMEOUT, .signal = SIGABRT) {
+	sf_remote_free(1);
+	void *x = sf_malloc(100);
+	sf_malloc(100);
+	pthread_t tid;
+	// A second free of a block that is still queued is caught.
+	pthread_create(&tid, NULL, remote_thread_free, x);
+	pthread_join(tid, NULL);
+	pthread_create(&tid, NULL, remote_thread_free, x);
+	pthread_join(tid, NULL);
+}
+
+Test(sfmm_basecode_suite, remote_double_free_sized, .timeout = TEST_TIMEOUT, .signal = SIGABRT) {
+	sf_remote_free(1);
+	void *x = sf_malloc(100);
+	sf_malloc(100);
+	pthread_t tid;
+	// The header check of sf_free_sized catches a block that is still queued too.
+	pthread_create(&tid, NULL, remote_thread_free, x);
+	pthread_join(tid, NULL);
+	sf_free_sized(x, 100);
+	cr_assert_fail("SIGABRT should have been received");
+}
+
+#define RING_THREADS 8
+#define RING_BLOCKS 64
+static void *ring[2][RING_THREADS][RING_BLOCKS]; //blocks of the previous round and this one
+static int ringRound;
+
+static void *remote_thread_ring(void *arg) {
+	long id = (long)arg;
+	void *(*prev)[RING_BLOCKS] = ring[(ringRound + 1) % 2], *(*next)[RING_BLOCKS] = ring[ringRound % 2];
+	// Each thread frees the blocks of the one before it, from an arena that is not its own.
+	long from = (id + RING_THREADS - 1) % RING_THREADS;
+	for(int i = 0; i < RING_BLOCKS && ringRound > 0; i++) {
+		if(*(char *)prev[from][i] != (char)from)
+			return "payload overwritten";
+		sf_free(prev[from][i]);
+	}
+	for(int i = 0; i < RING_BLOCKS; i++) {
+		size_t size = 8 + (id * 37 + i * 13 + ringRound) % 300;
+		if((next[id][i] = sf_malloc(size)) == NULL)
+			return "sf_malloc failed";
+		memset(next[id][i], (int)id, size);
+	}
+	return NULL;
+}
+
+Test(sfmm_basecode_suite, remote_free_tcache_threads, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	sf_tcache_limit(16 * 1024);
+	sf_slab_limit(64);
+	sf_compact_limit(32);
+	sf_remote_free(1);
+	sf_arena_config(RING_THREADS + 1, SF_ARENA_ROUND_ROBIN);
+	sf_free(sf_malloc(8));
+
+	// Cached blocks are handed out and queued again round after round, and none looks queued twice.
+	pthread_t tid[RING_THREADS];
+	for(ringRound = 0; ringRound < 50; ringRound++) {
+		for(long i = 0; i < RING_THREADS; i++)
+			pthread_create(&tid[i], NULL, remote_thread_ring, (void *)i);
+		for(int i = 0; i < RING_THREADS; i++) {
+			void *err = NULL;
+			pthread_join(tid[i], &err);
+			cr_assert_null(err, "Round %d thread %d: %s", ringRound, i, (char *)err);
+		}
+	}
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, cpu_cache_reuse, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	cr_assert(sf_cpu_cache_limit(64 * 1024) == 0, "CPU caches were on!");
+
+	// The first allocation carves a batch of 128 byte blocks, none of which reaches the free lists.
+	void *x = sf_malloc(100);
+	sf_free(x);
+	void *y = sf_malloc(100);
+	cr_assert(y == x, "Cached block was not reused (x=%p, y=%p)!", x, y);
+	sf_free(y);
+	assert_free_block_count(128, 0);
+
+	// Turning the caches off empties them, and everything coalesces back into the wilderness.
+	sf_cpu_cache_limit(0);
+	assert_free_block_count(0, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+#define OFF_THREADS 4
+#define OFF_BLOCKS 16
+static void *cpu_cache_thread_free(void *arg) {
+	void **blocks = arg;
+	for(int i = 0; i < OFF_BLOCKS; i++)
+		sf_free(blocks[i]);
+	return NULL;
+}
+
+Test(sfmm_basecode_suite, cpu_cache_off_while_freeing, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	static void *blocks[OFF_THREADS][OFF_BLOCKS];
+	pthread_t tid[OFF_THREADS];
+	for(int round = 0; round < 20; round++) {
+		for(int t = 0; t < OFF_THREADS; t++)
+			for(int i = 0; i < OFF_BLOCKS; i++)
+				blocks[t][i] = sf_malloc(40);
+		sf_cpu_cache_limit(64 * 1024);
+
+		// A block freed while the caches are turned off is either drained or never cached.
+		for(int t = 0; t < OFF_THREADS; t++)
+			pthread_create(&tid[t], NULL, cpu_cache_thread_free, blocks[t]);
+		sf_cpu_cache_limit(0);
+		for(int t = 0; t < OFF_THREADS; t++)
+			pthread_join(tid[t], NULL);
+		assert_free_block_count(0, 1);
+	}
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+static void *arena_thread_thp(void *arg) {
+	char *x = sf_malloc(3 << 20);
+	memset(x, 'a', 3 << 20);
+	sf_free(x);
+	return x;
+}
+
+Test(sfmm_basecode_suite, thp_heap_growth, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	cr_assert(sf_thp(1) == 0, "Huge pages were on!");
+
+	// Arena 0, which sf_mem_grow grows a page at a time, goes to this thread.
+	sf_free(sf_malloc(8));
+	struct sf_stats stats;
+	sf_stats(&stats);
+	size_t arena0 = stats.heap_size;
+
+	// Another arena's heap starts on a huge page boundary and grows to the next one.
+	pthread_t tid;
+	char *x;
+	pthread_create(&tid, NULL, arena_thread_thp, NULL);
+	pthread_join(tid, (void **) &x);
+	cr_assert(((uintptr_t) x - 48) % (2 << 20) == 0, "Heap does not start on a huge page (%p)!", x);
+	sf_stats(&stats);
+	cr_assert(stats.heap_size - arena0 == 4 << 20, "Heap did not grow in huge pages (%zu)!", stats.heap_size - arena0);
+	cr_assert(stats.thp_pages <= 2, "More huge pages than heap (%zu)!", stats.thp_pages);
+
+	// Trimming gives up the whole huge page past the one the kept bytes are in, and no part of it.
+	size_t released = sf_trim(PAGE_SZ);
+	cr_assert(released == 2 << 20, "Trimmed part of a huge page (%zu)!", released);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, footer_row_is_payload, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	// Without SF_FOOTERS the row an allocated block's footer would take holds payload.
+	char *x = sf_malloc(24);
+	char *y = sf_malloc(24);
+	cr_assert_eq(y - x, SF_FOOTERS ? 48 : 32, "Wrong block size (%ld)!", (long) (y - x));
+	cr_assert_eq(sf_usable_size(x), SF_FOOTERS ? 32 : 24, "Wrong usable size (%zu)!", sf_usable_size(x));
+	memset(x, 'x', sf_usable_size(x));
+	memset(y, 'y', sf_usable_size(y));
+
+	// Freeing x writes only its own footer, and y is told by its prv alloc bit.
+	sf_free(x);
+	for(size_t i = 0; i < sf_usable_size(y); i++) {
+		cr_assert(y[i] == 'y', "Payload of y was overwritten at %zu!", i);
+	}
+	cr_assert((((sf_block *) (y - 16))->header & 0x4) == 0, "Prev allocated bit of y is still set!");
+	sf_free(y);
+	assert_free_block_count(0, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}